@@ -17,21 +17,66 @@
 #include <stdint.h>
 
 /**
- * @brief Set target brightness
+ * @brief Fade rate in 8.8 fixed point, for rates that aren't whole PWM lsbs
+ * @param lsbs_ constant PWM lsbs to move per update, e.g. 0.25
+ */
+#define FADE_LSBS(lsbs_) ((uint16_t)((lsbs_)*256 + 0.5))
+
+/**
+ * @brief Set target brightness of every channel
  * @param target PWM brightness
  */
 void fade_set_brightness(uint8_t target);
 
 /**
- * @brief Set linear fade to target
+ * @brief Set linear fade to target of every channel
  * @param delta maximum number of PWM lsbs to move per update
  *        or 0 to pause fade
  */
 void fade_set_rate_linear(uint8_t delta);
 
+/**
+ * @brief Set linear fade to target of every channel, in fractions of a PWM lsb
+ * @param delta maximum PWM lsbs to move per update in 8.8 fixed point, see
+ *        FADE_LSBS(), or 0 to pause fade
+ * @note slow fades can update less often, with a fraction of an lsb each time,
+ *       rather than an lsb more often
+ */
+void fade_set_rate_linear_fixed(uint16_t delta);
+
+/**
+ * @brief Set exponential fade to target of every channel, which looks natural
+ *        for decay even at long update intervals
+ * @param shift move 1/2^shift of the remaining way, and at least 1/256 of a
+ *        PWM lsb, per update, e.g. 3 moves an eighth
+ */
+void fade_set_rate_exponential(uint8_t shift);
+
+/**
+ * @brief Set eased fade to target of every channel, following the curve of
+ *        FADE_EASING from the brightness each has now
+ * @param entries of FADE_EASING to move per update
+ * @note only with FADE_EASING in fade.config. Setting the target restarts
+ *       the curve.
+ */
+void fade_set_rate_eased(uint8_t entries);
+
+/**
+ * @brief Set the target brightness and linear fade of one channel, leaving
+ *        the others
+ * @param channel PWM channel in FADE_PWMS, others are ignored
+ * @param target PWM brightness
+ * @param delta maximum PWM lsbs to move per update in 8.8 fixed point, see
+ *        FADE_LSBS(), or 0 to pause its fade
+ * @note fade_set_brightness() and fade_set_rate_linear() set every channel
+ */
+void fade_set_channel(uint8_t channel, uint8_t target, uint16_t delta);
+
 /**
  * @brief Set fade cycle rate
  * @param milliseconds between each adjustment of registered PWMs
  *        or 0 to set target immediately, ignoring rate setting
+ * @note once every channel reaches target the fade stays dormant, costing no
+ *       wakes at all, until a setter here or pwm_set() of one of its channels
  */
 void fade_set_update(uint8_t milliseconds);
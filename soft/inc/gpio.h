@@ -15,6 +15,7 @@
  */
 
 #include <avr/io.h>
+#include <util/atomic.h>
 
 /**
  * @brief Configure a port+pin as a driven digital output
@@ -43,3 +44,70 @@
  * @paran pin_ pin number e.g. 2
  */
 #define GPIO_OUTPUT_GND(port_, pin_) { PORT##port_ &= ~(1<<(pin_)); }
+
+/**
+ * @brief Write every pin of a port at once
+ * @param port_ port letter e.g. B
+ * @param value_ bit per pin, 1 for Vcc or 0 for GND
+ */
+#define GPIO_PORT_WRITE(port_, value_) { PORT##port_ = (value_); }
+
+/**
+ * @brief Write some pins of a port at once, leaving the others
+ * @param port_ port letter e.g. B
+ * @param mask_ bit per pin to write
+ * @param value_ bit per pin within mask_, 1 for Vcc or 0 for GND
+ * @note interrupts are held off between reading the port and writing it
+ *       back, so an interrupt handler driving other pins isn't undone
+ */
+#define GPIO_PORT_UPDATE(port_, mask_, value_) \
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) GPIO_PORT_WRITE(port_, (PORT##port_ & ~(mask_)) | (value_))
+
+/**
+ * @brief Ports this MCU has, for metaprogramming a whole port at a time
+ * @param _ selector macro, passed the port letter e.g. B
+ */
+#define GPIO_PORTS(_) GPIO_PORT_A(_) GPIO_PORT_B(_) GPIO_PORT_C(_) GPIO_PORT_D(_)
+#ifdef PORTA
+# define GPIO_PORT_A(_) _(A)
+#else
+# define GPIO_PORT_A(_)
+#endif
+#ifdef PORTB
+# define GPIO_PORT_B(_) _(B)
+#else
+# define GPIO_PORT_B(_)
+#endif
+#ifdef PORTC
+# define GPIO_PORT_C(_) _(C)
+#else
+# define GPIO_PORT_C(_)
+#endif
+#ifdef PORTD
+# define GPIO_PORT_D(_) _(D)
+#else
+# define GPIO_PORT_D(_)
+#endif
+
+/**
+ * @brief Bit mask of the pins a port+pin list uses on one port
+ * @param list_ list macro like PWM_GPIOS, passed a port+pin selector
+ * @param port_ port letter e.g. B
+ * @note a constant expression, so it can even be used by #if
+ */
+#define GPIO_PORT_MASK(list_, port_) (0 list_(GPIO_PORT_MASK_##port_))
+#define GPIO_PORT_MASK_A(port_, pin_) | (GPIO_PORT_SAME(port_, A) << (pin_))
+#define GPIO_PORT_MASK_B(port_, pin_) | (GPIO_PORT_SAME(port_, B) << (pin_))
+#define GPIO_PORT_MASK_C(port_, pin_) | (GPIO_PORT_SAME(port_, C) << (pin_))
+#define GPIO_PORT_MASK_D(port_, pin_) | (GPIO_PORT_SAME(port_, D) << (pin_))
+
+/**
+ * @brief 1 if two port letters are the same, else 0
+ */
+#define GPIO_PORT_SAME(port_, other_) GPIO_PROBE(GPIO_PORT_SAME_##port_##_##other_)
+#define GPIO_PORT_SAME_A_A ~, 1
+#define GPIO_PORT_SAME_B_B ~, 1
+#define GPIO_PORT_SAME_C_C ~, 1
+#define GPIO_PORT_SAME_D_D ~, 1
+#define GPIO_PROBE(...) GPIO_PROBE2(__VA_ARGS__, 0, ~)
+#define GPIO_PROBE2(probe_, value_, ...) value_
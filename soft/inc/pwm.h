@@ -20,12 +20,60 @@
  * @brief Set the duty factor of a PWM channel
  * @param channel zero based
  * @param duty in range 0..255 = OFF..ON
+ * @note between pwm_begin() and pwm_commit() it's output with the rest of the
+ *       batch, otherwise straight away
  */
 void pwm_set(uint8_t channel, uint8_t duty);
 
 /**
  * @brief Get the duty factor of a PWM channel
  * @param channel zero based
- * @return 0..255 = OFF..ON
+ * @return 0..255 = OFF..ON, as last set even if not yet committed
  */
 uint8_t pwm_get(uint8_t channel);
+
+/**
+ * @brief Start a batch of pwm_set() calls, output together by pwm_commit()
+ * @note batches may nest, only the outermost pwm_commit() outputs
+ */
+void pwm_begin(void);
+
+/**
+ * @brief Output every duty set since pwm_begin() at once, so a frame never
+ *        shows half a batch and the output engine only updates once
+ */
+void pwm_commit(void);
+
+/**
+ * @brief Called by pwm_set() for every channel set, e.g. so fade can follow
+ *        duties set by effects
+ * @param channel zero based, always one that exists
+ * @note weak, so pwm_set() skips it unless some module defines it
+ */
+void pwm_set_hook(uint8_t channel) __attribute__((weak));
+
+/**
+ * @brief Output engines, selected by defining PWM_ENGINE in pwm.config
+ */
+#define PWM_ENGINE_SOFTWARE 0   /**< default, pwm_task() switches GPIOs on 1ms ticks */
+#define PWM_ENGINE_BAM 1        /**< TIMER1 interrupt outputs bit-angle modulation */
+#define PWM_ENGINE_FRAMES 2     /**< TIMER1 interrupt replays a table of edges */
+#define PWM_ENGINE_CHARLIE 3    /**< TIMER1 interrupt scans LEDs charlieplexed on CHARLIE_GPIOS */
+#define PWM_ENGINE_SHIFT 4      /**< TIMER1 interrupt shifts bit-angle modulation out of the USI */
+#define PWM_ENGINE_WS2812 5     /**< pwm_task() streams duties to a strip of WS2812 LEDs */
+
+/**
+ * @brief Initialiser for a table of the duty factor of each brightness 0..255,
+ *        255*(brightness/255)^gamma rounded. The compiler works it out so no
+ *        floating point reaches the target.
+ * @param gamma_ exponent, e.g. 2.2 for brightness to look linear
+ */
+#define PWM_GAMMA_TABLE(gamma_) PWM_GAMMA_64(gamma_, 0) PWM_GAMMA_64(gamma_, 64) \
+                                PWM_GAMMA_64(gamma_, 128) PWM_GAMMA_64(gamma_, 192)
+#define PWM_GAMMA_64(g_, b_) PWM_GAMMA_16(g_, b_) PWM_GAMMA_16(g_, (b_)+16) \
+                             PWM_GAMMA_16(g_, (b_)+32) PWM_GAMMA_16(g_, (b_)+48)
+#define PWM_GAMMA_16(g_, b_) PWM_GAMMA_4(g_, b_) PWM_GAMMA_4(g_, (b_)+4) \
+                             PWM_GAMMA_4(g_, (b_)+8) PWM_GAMMA_4(g_, (b_)+12)
+#define PWM_GAMMA_4(g_, b_) PWM_GAMMA_1(g_, b_) PWM_GAMMA_1(g_, (b_)+1) \
+                            PWM_GAMMA_1(g_, (b_)+2) PWM_GAMMA_1(g_, (b_)+3)
+#define PWM_GAMMA_1(g_, b_) (uint8_t)(__builtin_pow((b_)/255.0, (g_))*255 + 0.5),
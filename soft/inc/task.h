@@ -18,6 +18,8 @@
 
 #define TASK_STARTUP ((uint8_t)255) /**< special value to initialise */
 #define TASK_SHUTDOWN ((uint8_t)0)  /**< special value to shutdown */
+#define TASK_STARTUP16 ((uint16_t)65535) /**< special value to initialise 16-bit task */
+#define TASK_DORMANT16 ((uint16_t)65535) /**< special value to sleep until notified */
 
 /**
  * @brief Task cycle prototype
@@ -29,20 +31,178 @@
  * @returns requested maximum millisecond to call task again or @ref TASK_SHUTDOWN
  *          to request shutdown.
  *
- * @note the task runner may be called more frequently than the requested maximum
- *       and it is up to the task implementer to deal with this via the @ref ms_later
- *       value passed. It is guaranteed that @ref TASK_STARTUP and @ref TASK_SHUTDOWN
- *       values will only be passed once per session.
+ * @note the task runner is only called once its requested time has elapsed, and
+ *       @ref ms_later accumulates all the time since its last call, but it is still
+ *       up to the task implementer to deal with being called later than requested.
+ *       It is guaranteed that @ref TASK_STARTUP and @ref TASK_SHUTDOWN values will
+ *       only be passed once per session.
  */
 
 typedef uint8_t (*task_cycle)(uint8_t ms_later);
 
+/**
+ * @brief 16-bit task cycle prototype, for tasks that sleep longer than 254ms
+ *
+ * @param [in] ms_later as @ref task_cycle but @ref TASK_STARTUP16 on first call
+ *
+ * @returns as @ref task_cycle, up to 65534ms, or @ref TASK_DORMANT16 to not be
+ *          called again until task_notify16()
+ *
+ * @note a dormant task costs nothing while it sleeps, so a task with nothing
+ *       to do until something else changes can stay out of the way entirely
+ */
+typedef uint16_t (*task_cycle16)(uint16_t ms_later);
+
+/**
+ * @brief Entry in the linker's task list, see TASK_DECLARE()
+ */
+struct task_entry
+{
+    task_cycle cycle;   /**< task function, a task_cycle16 if wide */
+    uint8_t wide;       /**< non-zero for a TASK_DECLARE16() task */
+};
+
+/**
+ * @brief Priority of a task declared with TASK_DECLARE(), in the middle of the
+ *        two digit range 00 (first) to 99 (last)
+ */
+#define TASK_PRIORITY_DEFAULT 50
+
 /**
  * @brief Preprocessor and Linker magic to insert task cycle pointer into global task list
  * @param [in] task_cycle_ function pointer
  * @note see linker.ld for usage of .task_list section
  */
-#define TASK_DECLARE(task_cycle_) TASK_DECLARE2(task_cycle_, __LINE__)
-#define TASK_DECLARE2(task_cycle_, line_) TASK_DECLARE3(task_cycle_, line_)
-#define TASK_DECLARE3(task_cycle_, line_) \
-static volatile const task_cycle task_cycle_##line_ __attribute__((section(".task_list"))) = task_cycle_
+#define TASK_DECLARE(task_cycle_) TASK_DECLARE_PRIORITY(task_cycle_, TASK_PRIORITY_DEFAULT)
+
+/**
+ * @brief As TASK_DECLARE() but called in priority order relative to other tasks
+ * @param [in] task_cycle_ function pointer
+ * @param [in] priority_ two digits, 00 is called first and 99 last, so producers
+ *             like effects can update their output before consumers like PWM
+ *             use it in the same cycle
+ * @note see linker.ld which sorts the .task_list.NN sections by name, so
+ *       they're only in order with exactly two digits
+ */
+#define TASK_DECLARE_PRIORITY(task_cycle_, priority_) TASK_DECLARE2(task_cycle_, priority_, __LINE__)
+#define TASK_DECLARE2(task_cycle_, priority_, line_) TASK_DECLARE3(task_cycle_, priority_, line_)
+
+/**
+ * @brief Fail the build unless a priority is two digits, which 1 pasted in
+ *        front reads as 100..199 even when it starts 0
+ */
+#define TASK_PRIORITY_CHECK(priority_) \
+_Static_assert(1##priority_ >= 100 && 1##priority_ <= 199, "task priority must be two digits, 00 to 99")
+#if defined(TASK_STATIC)
+/* Makefile finds these in the objects to generate task_table.h for task.c */
+# define TASK_DECLARE3(task_cycle_, priority_, line_) \
+TASK_PRIORITY_CHECK(priority_); \
+extern __typeof__(task_cycle_) task_static8_##priority_##_##task_cycle_ __attribute__((alias(#task_cycle_)))
+#else
+# define TASK_DECLARE3(task_cycle_, priority_, line_) \
+TASK_PRIORITY_CHECK(priority_); \
+static volatile const struct task_entry task_cycle_##line_ __attribute__((section(".task_list." #priority_))) = { task_cycle_, 0 }
+#endif
+
+/**
+ * @brief As TASK_DECLARE() for a 16-bit task cycle pointer
+ * @param [in] task_cycle_ function pointer
+ * @note see linker.ld for usage of .task_list section
+ */
+#define TASK_DECLARE16(task_cycle_) TASK_DECLARE16_PRIORITY(task_cycle_, TASK_PRIORITY_DEFAULT)
+
+/**
+ * @brief As TASK_DECLARE_PRIORITY() for a 16-bit task cycle pointer
+ * @note shares the one priority order with 8-bit tasks, so either can
+ *       produce for the other
+ */
+#define TASK_DECLARE16_PRIORITY(task_cycle_, priority_) TASK_DECLARE16_2(task_cycle_, priority_, __LINE__)
+#define TASK_DECLARE16_2(task_cycle_, priority_, line_) TASK_DECLARE16_3(task_cycle_, priority_, line_)
+#if defined(TASK_STATIC)
+# define TASK_DECLARE16_3(task_cycle_, priority_, line_) \
+TASK_PRIORITY_CHECK(priority_); \
+extern __typeof__(task_cycle_) task_static16_##priority_##_##task_cycle_ __attribute__((alias(#task_cycle_)))
+#else
+# define TASK_DECLARE16_3(task_cycle_, priority_, line_) \
+TASK_PRIORITY_CHECK(priority_); \
+static volatile const struct task_entry task_cycle_##line_ __attribute__((section(".task_list." #priority_))) = { (task_cycle)task_cycle_, 1 }
+#endif
+
+/**
+ * @brief Write a task as straight-line code that sleeps, rather than as a
+ *        state machine with a wait accumulator, e.g.
+ *
+ *     static uint8_t blink_task(uint8_t ms_later)
+ *     {
+ *         TASK_BEGIN(ms_later);
+ *         for (;;)
+ *         {
+ *             led_on();
+ *             TASK_SLEEP(50);
+ *             led_off();
+ *             TASK_SLEEP(200);
+ *         }
+ *         TASK_END;
+ *     }
+ *
+ * @param [in] ms_later_ the task's parameter, 8 or 16-bit
+ * @note the code between TASK_BEGIN() and the first TASK_SLEEP() is run at
+ *       @ref TASK_STARTUP. TASK_BEGIN() returns at @ref TASK_SHUTDOWN so put
+ *       any tidying up before it.
+ * @note only the resume point survives TASK_SLEEP(), in a single static byte,
+ *       so any other state must be static too. Don't use switch() around a
+ *       TASK_SLEEP() either; the resume points are case labels.
+ */
+#define TASK_BEGIN(ms_later_) \
+    static uint8_t task_resume_; \
+    enum { task_resume_base_ = __COUNTER__ }; \
+    if ((ms_later_) == TASK_SHUTDOWN) \
+        return TASK_SHUTDOWN; \
+    if ((ms_later_) == (__typeof__(ms_later_))TASK_STARTUP16) \
+        task_resume_ = 0; \
+    switch (task_resume_) { case 0:
+
+/**
+ * @brief Return from a task started with TASK_BEGIN() and resume here next call
+ * @param [in] ms_ requested milliseconds, as returned by the task
+ * @note the task isn't called again until they have elapsed, so the resumed
+ *       code needn't look at ms_later
+ */
+#define TASK_SLEEP(ms_) TASK_SLEEP2(ms_, __COUNTER__ - task_resume_base_)
+#define TASK_SLEEP2(ms_, resume_) \
+    do { task_resume_ = (resume_); return (ms_); case (resume_):; } while (0)
+
+/**
+ * @brief End a task started with TASK_BEGIN(), which then sleeps until shutdown
+ *        if it ever gets this far
+ */
+#define TASK_END \
+    for (;;) TASK_SLEEP(TASK_STARTUP-1); \
+    } \
+    return TASK_STARTUP-1
+
+/**
+ * @brief Run a task at the next millisecond, whatever it asked to sleep for
+ * @param [in] task function pointer as passed to TASK_DECLARE()
+ * @note may be called from an interrupt handler, e.g. on a pin change, to
+ *       cut the current sleep short. The task gets the real milliseconds
+ *       elapsed since it was last called, which is at least 1.
+ */
+void task_notify(task_cycle task);
+
+/**
+ * @brief As task_notify() for a task passed to TASK_DECLARE16()
+ * @param [in] task function pointer
+ */
+void task_notify16(task_cycle16 task);
+
+/**
+ * @brief Keep the CPU from powering down until the calling task is next
+ *        called, so it only idles between tasks
+ * @note power down stops every clock but the watchdog, which only times long
+ *       sleeps to a few percent. A task relying on another clock, like TIMER1
+ *       generating PWM, or on exact millisecond timing calls this each time
+ *       it runs for as long as it does.
+ * @note only has an effect when called from a task
+ */
+void task_stay_awake(void);
@@ -19,6 +19,7 @@
 #include "task.h"
 
 #include <stdbool.h>
+#include <avr/pgmspace.h>
 
 /* Select configuration */
 #ifndef FADE_CONFIG
@@ -41,75 +42,357 @@
 # define STATIC static
 #endif
 
-STATIC uint8_t fade_target;
+/** Number of channels in FADE_PWMS */
+#define FADE_CHANNELS (0 FADE_PWMS(FADE_COUNT))
+#define FADE_COUNT(channel_) +1
+
+/* Profile of each fade, from the last rate set */
+#define FADE_PROFILE_LINEAR 0       /**< rate is lsbs per update, 8.8 fixed point */
+#define FADE_PROFILE_EXPONENTIAL 1  /**< rate is a shift, moving 1/2^shift of the way */
+#define FADE_PROFILE_EASED 2        /**< rate is FADE_EASING entries per update */
+
+/**
+ * Fade of each channel, in FADE_PWMS order
+ */
+static struct
+{
+    uint8_t target;     /**< brightness to fade to */
+    uint8_t fraction;   /**< brightness below the PWM lsb in 256ths, or FADE_EASING entry */
+    uint16_t rate;      /**< how fast, as the profile says */
+    uint8_t profile;    /**< FADE_PROFILE_... */
+#ifdef FADE_EASING
+    uint8_t start;      /**< brightness an eased fade started from */
+#endif
+} fade_channels[FADE_CHANNELS];
+
 STATIC uint8_t fade_cycle_ms;
-STATIC uint8_t fade_rate;
+
+/* Bit per channel, in FADE_PWMS order, that may not be at target. Only
+ * those are visited each update.
+ */
+#if FADE_CHANNELS <= 8
+typedef uint8_t fade_mask;
+#elif FADE_CHANNELS <= 16
+typedef uint16_t fade_mask;
+#elif FADE_CHANNELS <= 32
+typedef uint32_t fade_mask;
+#else
+# error "FADE_PWMS may have up to 32 channels"
+#endif
+#define FADE_ALL ((fade_mask)((1ull << FADE_CHANNELS) - 1))
+
+STATIC fade_mask fade_active;
+
+static uint16_t fade_task(uint16_t ms_later);
+
+/**
+ * @brief Find a channel in FADE_PWMS
+ * @param channel PWM channel
+ * @return its bit, or 0 if it's not faded
+ */
+static fade_mask fade_bit(uint8_t channel)
+{
+    fade_mask bits = 0;
+    fade_mask bit = 1;
+#define FADE_CHANNEL_BIT(channel_)                  \
+    if (channel == (channel_))                      \
+        bits |= bit;                                \
+    bit <<= 1;
+    FADE_PWMS(FADE_CHANNEL_BIT);
+#undef FADE_CHANNEL_BIT
+    return bits;
+}
+
+/**
+ * @brief Mark channels as fading, waking fade_task() if they were all at
+ *        target
+ * @param bits of channels in FADE_PWMS order
+ */
+static void fade_activate(fade_mask bits)
+{
+    /* fade_task() is only dormant while nothing is fading. Its own pwm_set()
+     * calls are for channels already marked, so they don't wake it again.
+     */
+    if (!fade_active && bits)
+        task_notify16(fade_task);
+    fade_active |= bits;
+}
+
+void pwm_set_hook(uint8_t channel)
+{
+    /* Effects set duties directly, so fade it back to target */
+    fade_activate(fade_bit(channel));
+}
+
+#ifdef FADE_EASING
+/**
+ * Fraction of the way to target, 0..255, after each update of an eased fade
+ */
+STATIC const uint8_t fade_easing[] PROGMEM =
+{
+#define FADE_EASING_ENTRY(fraction_) fraction_,
+FADE_EASING(FADE_EASING_ENTRY)
+#undef FADE_EASING_ENTRY
+};
+
+/**
+ * @brief Start eased fades from the current brightness of every channel
+ */
+static void fade_restart_eased(void)
+{
+    uint8_t i = 0;
+#define FADE_RESTART_EASED(channel_)                    \
+    if (fade_channels[i].profile == FADE_PROFILE_EASED) \
+    {                                                   \
+        fade_channels[i].start = pwm_get(channel_);     \
+        fade_channels[i].fraction = 0;                  \
+    }                                                   \
+    i++;
+    FADE_PWMS(FADE_RESTART_EASED);
+#undef FADE_RESTART_EASED
+}
+#endif
 
 void fade_set_brightness(uint8_t target)
 {
-    fade_target = target;
+    for (uint8_t i = 0; i < FADE_CHANNELS; i++)
+        fade_channels[i].target = target;
+    fade_activate(FADE_ALL);
+
+#ifdef FADE_EASING
+    fade_restart_eased();
+#endif
+}
+
+/**
+ * @brief Set the fade profile and rate of every channel
+ * @param profile FADE_PROFILE_...
+ * @param rate as the profile says
+ */
+static void fade_set_rate(uint8_t profile, uint16_t rate)
+{
+    for (uint8_t i = 0; i < FADE_CHANNELS; i++)
+    {
+        fade_channels[i].fraction = 0;
+        fade_channels[i].rate = rate;
+        fade_channels[i].profile = profile;
+    }
+    fade_activate(FADE_ALL);
 }
 
 void fade_set_rate_linear(uint8_t delta)
 {
-    fade_rate = delta;
+    fade_set_rate(FADE_PROFILE_LINEAR, (uint16_t)delta << 8);
 }
 
+void fade_set_rate_linear_fixed(uint16_t delta)
+{
+    fade_set_rate(FADE_PROFILE_LINEAR, delta);
+}
+
+void fade_set_rate_exponential(uint8_t shift)
+{
+    fade_set_rate(FADE_PROFILE_EXPONENTIAL, shift);
+}
+
+#ifdef FADE_EASING
+void fade_set_rate_eased(uint8_t entries)
+{
+    fade_set_rate(FADE_PROFILE_EASED, entries);
+    fade_restart_eased();
+}
+#endif
+
 void fade_set_update(uint8_t milliseconds)
 {
     fade_cycle_ms = milliseconds;
+
+    /* Take up the new period now, rather than after the old one */
+    task_notify16(fade_task);
+}
+
+void fade_set_channel(uint8_t channel, uint8_t target, uint16_t delta)
+{
+    uint8_t i = 0;
+#define FADE_SET_CHANNEL(channel_)                  \
+    if (channel == (channel_))                      \
+    {                                               \
+        fade_channels[i].target = target;           \
+        fade_channels[i].fraction = 0;              \
+        fade_channels[i].rate = delta;              \
+        fade_channels[i].profile = FADE_PROFILE_LINEAR; \
+    }                                               \
+    i++;
+    FADE_PWMS(FADE_SET_CHANNEL);
+#undef FADE_SET_CHANNEL
+    fade_activate(fade_bit(channel));
 }
 
 /**
- * @brief Apply fade_target, fade_rate to adjust brightness linearly
- * @param previous brightness
- * @return next brightness
+ * @brief Adjust brightness linearly towards a target
+ * @param previous brightness, 8.8 fixed point
+ * @param brightness to fade to
+ * @param rate maximum PWM lsbs to move, 8.8 fixed point
+ * @return next brightness, 8.8 fixed point
  */
-STATIC uint8_t fade_adjust_linear(uint8_t previous)
+STATIC uint16_t fade_adjust_linear(uint16_t previous, uint8_t brightness, uint16_t rate)
 {
-    if (fade_target == previous)
+    uint16_t target = (uint16_t)brightness << 8;
+
+    if (target == previous)
     {
         /* Target achieved */
-        return fade_target;
+        return target;
     }
-    else if (previous > fade_target)
+    else if (previous > target)
     {
         /* Fade down */
-        if ((previous-fade_target) > fade_rate)
+        if ((previous-target) > rate)
         {
             /* Tracking */
-            return previous-fade_rate;
+            return previous-rate;
         }
         else
         {
             /* Achieved */
-            return fade_target;
+            return target;
         }
     }
     else
     {
         /* Fade up */
-        if ((fade_target-previous) > fade_rate)
+        if ((target-previous) > rate)
         {
             /* Tracking */
-            return previous+fade_rate;
+            return previous+rate;
         }
         else
         {
             /* Achieved */
-            return fade_target;
+            return target;
         }
     }
 }
 
-static uint8_t fade_task(uint8_t ms_later)
+/**
+ * @brief Adjust brightness exponentially towards a target, by shift and
+ *        subtract
+ * @param previous brightness, 8.8 fixed point
+ * @param brightness to fade to
+ * @param shift moves 1/2^shift of the way, at least 1/256 lsb
+ * @return next brightness, 8.8 fixed point
+ */
+STATIC uint16_t fade_adjust_exponential(uint16_t previous, uint8_t brightness, uint8_t shift)
+{
+    uint16_t target = (uint16_t)brightness << 8;
+    uint16_t step;
+
+    if (previous > target)
+    {
+        /* Fade down */
+        step = (previous-target) >> shift;
+        return previous - (step ? step : 1);
+    }
+    else if (previous < target)
+    {
+        /* Fade up */
+        step = (target-previous) >> shift;
+        return previous + (step ? step : 1);
+    }
+
+    /* Target achieved */
+    return target;
+}
+
+#ifdef FADE_EASING
+/**
+ * @brief Brightness part way through an eased fade
+ * @param start brightness faded from
+ * @param brightness to fade to
+ * @param entry of fade_easing[] reached
+ * @return brightness
+ */
+STATIC uint8_t fade_adjust_eased(uint8_t start, uint8_t brightness, uint8_t entry)
+{
+    uint8_t fraction = pgm_read_byte(&fade_easing[entry]);
+
+    /* fraction/255 of the span, rounding to hit it exactly at 255 */
+    if (brightness >= start)
+    {
+        uint8_t span = brightness - start;
+        return start + (uint8_t)(((uint16_t)span*fraction + span) >> 8);
+    }
+    else
+    {
+        uint8_t span = start - brightness;
+        return start - (uint8_t)(((uint16_t)span*fraction + span) >> 8);
+    }
+}
+#endif
+
+/**
+ * @brief Take a channel's fade one update further
+ * @param i index of the channel in FADE_PWMS
+ * @param channel PWM channel
+ * @return whether it's still fading
+ */
+static bool fade_update(uint8_t i, uint8_t channel)
+{
+    uint8_t duty = pwm_get(channel);
+    uint8_t target = fade_channels[i].target;
+
+#ifdef FADE_EASING
+    if (fade_channels[i].profile == FADE_PROFILE_EASED)
+    {
+        uint8_t last = sizeof(fade_easing) - 1;
+        uint8_t entry = fade_channels[i].fraction;
+        if (entry == last && duty == target)
+            return false;
+
+        entry = (last - entry > fade_channels[i].rate) ? entry + fade_channels[i].rate : last;
+        fade_channels[i].fraction = entry;
+        pwm_set(channel, fade_adjust_eased(fade_channels[i].start, target, entry));
+        return true;
+    }
+#endif
+
+    uint16_t previous = ((uint16_t)duty << 8) | fade_channels[i].fraction;
+    uint16_t next = (fade_channels[i].profile == FADE_PROFILE_EXPONENTIAL)
+                    ? fade_adjust_exponential(previous, target, fade_channels[i].rate)
+                    : fade_adjust_linear(previous, target, fade_channels[i].rate);
+    if (next == previous)
+        return false;
+
+    fade_channels[i].fraction = next & 0xFF;
+    if ((next >> 8) != duty)
+        pwm_set(channel, next >> 8);
+    return true;
+}
+
+/**
+ * @brief Finish a channel's fade at once
+ * @param i index of the channel in FADE_PWMS
+ * @param channel PWM channel
+ */
+static void fade_finish(uint8_t i, uint8_t channel)
 {
-    static uint8_t tick;
+    fade_channels[i].fraction = 0;
+#ifdef FADE_EASING
+    if (fade_channels[i].profile == FADE_PROFILE_EASED)
+        fade_channels[i].fraction = sizeof(fade_easing) - 1;
+#endif
+    pwm_set(channel, fade_channels[i].target);
+}
+
+static uint16_t fade_task(uint16_t ms_later)
+{
+    static uint16_t tick;
 
     switch(ms_later)
     {
-    case TASK_STARTUP:
+    case TASK_STARTUP16:
         tick = 0;
+        fade_active = FADE_ALL;
         return 1;
 
     case TASK_SHUTDOWN:
@@ -119,44 +402,56 @@ static uint8_t fade_task(uint8_t ms_later)
         if (!fade_cycle_ms)
         {
             /* Achieve target immediately */
-#define FADE_SET_TARGET(channel_) pwm_set(channel_, fade_target);
+            uint8_t i = 0;
+            fade_mask bit = 1;
+            pwm_begin();
+#define FADE_SET_TARGET(channel_)                               \
+            if (fade_active & bit)                              \
+                fade_finish(i, channel_);                       \
+            i++;                                                \
+            bit <<= 1;
             FADE_PWMS(FADE_SET_TARGET);
 #undef FADE_SET_TARGET
+            pwm_commit();
+            fade_active = 0;
 
-            /* And now idle */
+            /* And now dormant, until a target or duty is set */
             tick = 0;
-            return 255;
+            return TASK_DORMANT16;
         }
         else
         {
-            /* Ready for another cycle? */
-            tick += ms_later;
+            /* Ready for another cycle? Woken from dormant, ms_later may
+             * be long overdue
+             */
+            tick += (ms_later < fade_cycle_ms) ? ms_later : fade_cycle_ms;
             if (tick < fade_cycle_ms)
             {
                 return fade_cycle_ms-tick;
             }
             tick = 0;
             
-            /* Iterate over PWM channels, adjusting each */
-            bool idle = true;
+            /* Adjust each PWM channel still fading, all output together */
+            uint8_t i = 0;
+            fade_mask bit = 1;
+            pwm_begin();
 #define FADE_TO_TARGET(channel_)                                \
-            {                                                   \
-                uint8_t previous = pwm_get(channel_);           \
-                uint8_t next = fade_adjust_linear(previous);    \
-                if (next != previous)                           \
-                {                                               \
-                    idle = false;                               \
-                    pwm_set(channel_, next);                    \
-                }                                               \
-            }
+            if ((fade_active & bit) && !fade_update(i, channel_)) \
+                fade_active &= ~bit;                            \
+            i++;                                                \
+            bit <<= 1;
             FADE_PWMS(FADE_TO_TARGET);
 #undef FADE_TO_TARGET
+            pwm_commit();
 
-            return idle ? 255 : fade_cycle_ms;
+            return fade_active ? fade_cycle_ms : TASK_DORMANT16;
         }
     }
 }
 
-TASK_DECLARE(fade_task);
+/* After effects set targets, before PWM outputs them. 16-bit so it can lie
+ * dormant until they do.
+ */
+TASK_DECLARE16_PRIORITY(fade_task, 60);
 
 #endif /* defined(FADE_PWMS) */
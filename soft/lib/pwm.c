@@ -18,12 +18,22 @@
 #include "gpio.h"
 #include "task.h"
 
+#include <stdbool.h>
+#include <avr/pgmspace.h>
+
 /* Select configuration */
-#ifndef PWM_COMFIG
+#ifndef PWM_CONFIG
 # define PWM_CONFIG "pwm.config"
 #endif
 
 #define PWM_CYCLE_MILLISECONDS 16     /**< 67Hz cycle */
+#define PWM_STEADY_MILLISECONDS 64    /**< sleep while no channel is switching */
+#define PWM_PHASE_MILLISECONDS 4      /**< channel phase step, so switching is at most 250Hz */
+
+/**
+ * @brief Highest duty a tick is compared against, so any higher is always ON
+ */
+#define PWM_DUTY_MAX ((256u*(PWM_CYCLE_MILLISECONDS-1))/PWM_CYCLE_MILLISECONDS)
 
 /* This is metaprogramming - more common in languages like C++ - where
  * a template causes specialised code to be generated as opposed to
@@ -34,7 +44,76 @@
  */
 #include PWM_CONFIG
 
-#if defined(PWM_GPIOS)
+#ifndef PWM_ENGINE
+# define PWM_ENGINE PWM_ENGINE_SOFTWARE
+#endif
+
+#if defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_SOFTWARE
+
+#ifdef TEST
+# define STATIC /* extern */
+#else
+# define STATIC static
+#endif
+
+/* TIMER1 compare outputs drive channels on their pins in hardware at full
+ * 8-bit resolution, without the CPU. TIMER0 is the scheduler's tick so its
+ * OC0A/OC0B pins are left to software.
+ *
+ * PWM_OC_<port>_<pin> marks an OC pin with a probe: ~ then its output name.
+ */
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+# define PWM_OC_B_1 ~, 1A
+# define PWM_OC_B_2 ~, 1B
+/* Fast PWM 8-bit, clk/64 */
+# define PWM_TIMER1_START() { TCCR1A = 1<<WGM10; TCCR1B = (1<<WGM12) | (1<<CS11) | (1<<CS10); }
+# define PWM_TIMER1_STOP() { TCCR1B = 0; TCCR1A = 0; }
+# define PWM_OC_CONTROL_1A TCCR1A
+# define PWM_OC_CONTROL_1B TCCR1A
+#else
+# define PWM_OC_B_1 ~, 1A
+# define PWM_OC_B_4 ~, 1B
+/* PWM A and B up to OCR1C, clk/64 */
+# define PWM_TIMER1_START() { OCR1C = 255; GTCCR = 1<<PWM1B; \
+                              TCCR1 = (1<<PWM1A) | (1<<CS12) | (1<<CS11) | (1<<CS10); }
+# define PWM_TIMER1_STOP() { TCCR1 = 0; GTCCR = 0; }
+# define PWM_OC_CONTROL_1A TCCR1
+# define PWM_OC_CONTROL_1B GTCCR
+#endif
+
+/**
+ * @brief OC output of a port+pin, e.g. 1A, or NONE if it's software driven
+ */
+#define PWM_OC(port_, pin_) PWM_OC_SELECT(PWM_OC_##port_##_##pin_, NONE, ~)
+#define PWM_OC_SELECT(...) PWM_OC_SELECT2(__VA_ARGS__)
+#define PWM_OC_SELECT2(probe_, oc_, ...) oc_
+#define PWM_CAT(a_, b_) PWM_CAT2(a_, b_)
+#define PWM_CAT2(a_, b_) a_##b_
+
+/**
+ * @brief 1 if a port+pin is driven by TIMER1, else 0
+ */
+#define PWM_OC_IS_HARDWARE(port_, pin_) PWM_CAT(PWM_OC_IS_, PWM_OC(port_, pin_))
+#define PWM_OC_IS_NONE 0
+#define PWM_OC_IS_1A 1
+#define PWM_OC_IS_1B 1
+
+/**
+ * @brief Output a duty on a port+pin driven by TIMER1, else nothing
+ * @note OFF disconnects the pin, which would otherwise glitch ON once a cycle
+ */
+#define PWM_OC_OUTPUT(port_, pin_, duty_) PWM_CAT(PWM_OC_OUTPUT_, PWM_OC(port_, pin_))(duty_)
+#define PWM_OC_OUTPUT_NONE(duty_)
+#define PWM_OC_OUTPUT_1A(duty_) PWM_OC_WRITE(OCR1A, PWM_OC_CONTROL_1A, COM1A1, duty_)
+#define PWM_OC_OUTPUT_1B(duty_) PWM_OC_WRITE(OCR1B, PWM_OC_CONTROL_1B, COM1B1, duty_)
+#define PWM_OC_WRITE(compare_, control_, connect_, duty_) \
+    {                                                     \
+        compare_ = (duty_);                               \
+        if (duty_)                                        \
+            control_ |= 1<<(connect_);                    \
+        else                                              \
+            control_ &= ~(1<<(connect_));                 \
+    }
 
 /**
  * Array of duty factors, initialised to the number of PWM GPIOs configured
@@ -46,15 +125,87 @@ PWM_GPIOS(PWM_GPIO_DUTY)
 #undef PWM_GPIO_DUTY
 };
 
-void pwm_set(uint8_t channel, uint8_t duty)
+/** pwm_task() is in its steady sleep, so must be woken for a new duty */
+static bool pwm_steady;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+/**
+ * Number of channels switched by pwm_task(), the rest are driven by TIMER1
+ */
+STATIC const uint8_t pwm_software_channels = sizeof(pwm_duty)
+#define PWM_GPIO_HARDWARE(port_,pin_) - PWM_OC_IS_HARDWARE(port_, pin_)
+PWM_GPIOS(PWM_GPIO_HARDWARE)
+#undef PWM_GPIO_HARDWARE
+;
+
+/**
+ * @brief Copy duties to the TIMER1 compare outputs
+ */
+static void pwm_output_hardware(void)
+{
+    uint8_t channel = 0;
+#define PWM_GPIO_OUTPUT_HARDWARE(port_,pin_) \
+    PWM_OC_OUTPUT(port_, pin_, pwm_duty[channel]) \
+    channel++;
+PWM_GPIOS(PWM_GPIO_OUTPUT_HARDWARE)
+#undef PWM_GPIO_OUTPUT_HARDWARE
+    (void)channel;
+}
+
+/**
+ * @brief Output the duties set, hardware channels straight away and software
+ *        ones from pwm_task()'s next call
+ */
+static void pwm_output(void)
 {
-    if (channel < sizeof(pwm_duty))
-        pwm_duty[channel] = duty;
+    pwm_output_hardware();
+    if (pwm_steady)
+    {
+        pwm_steady = false;
+        task_notify(pwm_task);
+    }
 }
 
-uint8_t pwm_get(uint8_t channel)
+#include "pwm_common.h"
+
+/* Software channels all switching ON at once would draw their current
+ * together, so their cycles start spread over the cycle in order, on
+ * PWM_PHASE_MILLISECONDS steps, spreading their ON times out.
+ */
+#define PWM_PHASE_ON 0x80   /**< pwm_phase_switch() flags the channel ON */
+
+/**
+ * @brief Work out whether a software channel is ON and when it next switches
+ * @param channel zero based
+ * @param software channel's place among the software channels
+ * @param tick within cycle
+ * @return milliseconds until it switches, or 0 if it never does, ORed with
+ *         PWM_PHASE_ON if it's ON now
+ */
+static inline uint8_t pwm_phase_switch(uint8_t channel, uint8_t software, uint8_t tick)
 {
-    return (channel < sizeof(pwm_duty)) ? pwm_duty[channel] : 0;
+    /* Tick within the channel's own cycle */
+    uint8_t phase = (software*PWM_CYCLE_MILLISECONDS)/pwm_software_channels;
+    phase -= phase % PWM_PHASE_MILLISECONDS;
+    tick = (uint8_t)(tick + PWM_CYCLE_MILLISECONDS - phase) % PWM_CYCLE_MILLISECONDS;
+
+#if (PWM_CYCLE_MILLISECONDS&(PWM_CYCLE_MILLISECONDS-1)) != 0
+# warning "For efficiency, PWM_CYCLE_MILLISECONDS ought to be a power of 2"
+#endif
+    /* NOTE: looks complicated but gcc optimises to ROTATE and AND */
+    uint8_t duty = (256u*(uint16_t)tick)/(uint8_t)PWM_CYCLE_MILLISECONDS;
+    uint8_t on = (pwm_duty[channel] > duty) ? PWM_PHASE_ON : 0;
+
+    /* Always OFF or always ON */
+    if (!pwm_duty[channel] || pwm_duty[channel] > PWM_DUTY_MAX)
+        return on;
+
+    /* ON until the tick past its duty, then OFF until its next cycle */
+    if (!on)
+        return PWM_CYCLE_MILLISECONDS - tick;
+    uint8_t off_tick = (PWM_CYCLE_MILLISECONDS*(uint16_t)(pwm_duty[channel]+1))/256u;
+    return on | ((off_tick > tick) ? off_tick - tick : 1);
 }
 
 static uint8_t pwm_task(uint8_t ms_later)
@@ -65,12 +216,20 @@ static uint8_t pwm_task(uint8_t ms_later)
     {
     case TASK_STARTUP:
         tick = ~0;
+        pwm_steady = false;
         /* Enable outputs */
         PWM_GPIOS(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        if (pwm_software_channels < sizeof(pwm_duty))
+        {
+            PWM_TIMER1_START();
+            pwm_output_hardware();
+        }
         return 1;
 
     case TASK_SHUTDOWN:
         /* Disable outputs */
+        if (pwm_software_channels < sizeof(pwm_duty))
+            PWM_TIMER1_STOP();
         PWM_GPIOS(GPIO_CONFIGURE_UNUSED);
         return 1;
 
@@ -80,38 +239,69 @@ static uint8_t pwm_task(uint8_t ms_later)
             tick += ms_later;
             tick %= PWM_CYCLE_MILLISECONDS;
 
-            /* Work out corresponding duty */
-#if (PWM_CYCLE_MILLISECONDS&(PWM_CYCLE_MILLISECONDS-1)) != 0
-# warning "For efficiency, PWM_CYCLE_MILLISECONDS ought to be a power of 2"
-#endif
-            /* NOTE: looks complicated but gcc optimises to ROTATE and AND */
-            uint8_t duty = (256u*(uint16_t)tick)
-                           /(uint8_t)PWM_CYCLE_MILLISECONDS;
-
-            /* Switch GPIOs ON/OFF according to duty setting vs tick count */
+            /* Work out GPIOs ON/OFF according to duty setting vs tick count
+             * since the channel's phase, collecting the pins to switch ON in
+             * each port and how soon any channel switches next
+             */
             uint8_t channel = 0;
-            uint8_t next_duty = 255;
-#define PWM_GPIO_PORT_SWITCH(port_,pin_)                \
-            if (pwm_duty[channel] > duty)               \
-            {                                           \
-                GPIO_OUTPUT_Vcc(port_, pin_); /* ON */  \
-                if (pwm_duty[channel] < next_duty)      \
-                    next_duty = pwm_duty[channel];      \
-            }                                           \
-            else                                        \
-                GPIO_OUTPUT_GND(port_, pin_); /* OFF */ \
+            uint8_t software = 0;
+            uint8_t next_ms = PWM_CYCLE_MILLISECONDS;
+            bool switching = false;
+            bool dimmed = false;
+#define PWM_PORT_ON(port_) uint8_t on_##port_ = 0;
+GPIO_PORTS(PWM_PORT_ON)
+#undef PWM_PORT_ON
+#define PWM_GPIO_PORT_SWITCH(port_,pin_)                    \
+            if (PWM_OC_IS_HARDWARE(port_, pin_))            \
+            {                                               \
+                if (pwm_duty[channel] && pwm_duty[channel] < 255) \
+                    dimmed = true;                          \
+            }                                               \
+            else                                            \
+            {                                               \
+                uint8_t ms = pwm_phase_switch(channel, software++, tick); \
+                if (ms & PWM_PHASE_ON)                      \
+                    on_##port_ |= 1<<(pin_);                \
+                ms &= ~PWM_PHASE_ON;                        \
+                if (ms)                                     \
+                {                                           \
+                    switching = true;                       \
+                    if (ms < next_ms)                       \
+                        next_ms = ms;                       \
+                }                                           \
+            }                                               \
             channel++;
 PWM_GPIOS(PWM_GPIO_PORT_SWITCH)
 #undef PWM_GPIO_PORT_SWITCH
 
-            /* Find out when the next transition will occur */
-            uint8_t next_tick = (PWM_CYCLE_MILLISECONDS*(uint16_t)(next_duty+1))
-                                /256u;
-            return (tick == next_tick) ? 1 : next_tick-tick;
+            /* Switch each port's PWM pins together in a single write, the
+             * rest are left alone. Hardware channel pins are always OFF.
+             */
+#define PWM_PORT_SWITCH(port_)                                              \
+            if (GPIO_PORT_MASK(PWM_GPIOS, port_))                           \
+                GPIO_PORT_UPDATE(port_, GPIO_PORT_MASK(PWM_GPIOS, port_), on_##port_);
+GPIO_PORTS(PWM_PORT_SWITCH)
+#undef PWM_PORT_SWITCH
+
+            /* Switching software channels needs exact milliseconds, and
+             * dimming hardware ones needs TIMER1
+             */
+            if (switching || dimmed)
+                task_stay_awake();
+
+            /* Every channel fully ON or OFF so let the CPU sleep, until
+             * a new duty wakes us
+             */
+            pwm_steady = !switching;
+            if (pwm_steady)
+                return PWM_STEADY_MILLISECONDS;
+
+            return next_ms;
         }
     }
 }
 
-TASK_DECLARE(pwm_task);
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
 
-#endif /* defined(PWM_GPIOS) */
+#endif /* defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_SOFTWARE */
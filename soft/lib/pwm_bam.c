@@ -0,0 +1,235 @@
+/*! \file pwm_bam.c
+ *
+ *  \brief Bit-angle modulation Pulse Width Modulation implementation
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pwm.h"
+#include "gpio.h"
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Select configuration */
+#ifndef PWM_CONFIG
+# define PWM_CONFIG "pwm.config"
+#endif
+
+#include PWM_CONFIG
+
+#if defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_BAM
+
+/* Bit-angle modulation splits each frame into 8 bit-planes, plane n lasting
+ * 2^n units, and outputs bit n of every duty during plane n. That's 8 TIMER1
+ * interrupts per frame however many channels there are, each writing whole
+ * ports, and full 8-bit resolution.
+ */
+
+#define PWM_BAM_HZ 200                  /**< frame rate */
+#define PWM_BAM_STEADY_MILLISECONDS 64  /**< sleep, as TIMER1 does the work */
+
+/** Number of ports with PWM pins */
+#define PWM_BAM_PORTS (0 GPIO_PORTS(PWM_BAM_PORT_USED))
+#define PWM_BAM_PORT_USED(port_) + (GPIO_PORT_MASK(PWM_GPIOS, port_) != 0)
+
+/**
+ * @brief CPU cycles in plane 0, 1/255 of a frame
+ * @note plane 0 must outlast its own interrupt, so slow clocks lower the
+ * frame rate. Counting its instructions gives about 60 cycles plus 12 a
+ * port; that's an estimate, not measured, so check the TIMER1 compare vector
+ * in the .lst listing when changing it.
+ */
+#define PWM_BAM_MIN_CYCLES (80 + 16*PWM_BAM_PORTS)
+#define PWM_BAM_UNIT_CYCLES ((F_CPU/(255ul*PWM_BAM_HZ) > PWM_BAM_MIN_CYCLES) \
+                             ? F_CPU/(255ul*PWM_BAM_HZ) : PWM_BAM_MIN_CYCLES)
+
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+/* 16-bit CTC up to OCR1A at clk/1, doubling the count each plane */
+# define PWM_BAM_TIMER_START() { TCCR1A = 0; TCCR1B = (1<<WGM12) | (1<<CS10); TIMSK1 |= 1<<OCIE1A; }
+# define PWM_BAM_TIMER_STOP() { TIMSK1 &= ~(1<<OCIE1A); TCCR1B = 0; }
+# define PWM_BAM_TIMER_PLANE(plane_) (OCR1A = ((uint16_t)PWM_BAM_UNIT_CYCLES << (plane_)) - 1)
+#else
+/* 8-bit CTC up to OCR1C, doubling the clock divider each plane */
+# define PWM_BAM_CLOCK_SELECT (1 + (PWM_BAM_UNIT_CYCLES > 256) + (PWM_BAM_UNIT_CYCLES > 512) \
+                                 + (PWM_BAM_UNIT_CYCLES > 1024) + (PWM_BAM_UNIT_CYCLES > 2048))
+# define PWM_BAM_TIMER_START() { OCR1C = OCR1A = (PWM_BAM_UNIT_CYCLES >> (PWM_BAM_CLOCK_SELECT-1)) - 1; \
+                                 TIMSK |= 1<<OCIE1A; }
+# define PWM_BAM_TIMER_STOP() { TIMSK &= ~(1<<OCIE1A); TCCR1 = 0; }
+# define PWM_BAM_TIMER_PLANE(plane_) (TCCR1 = (1<<CTC1) | (PWM_BAM_CLOCK_SELECT + (plane_)))
+#endif
+
+/**
+ * Array of duty factors, initialised to the number of PWM GPIOs configured
+ */
+static uint8_t pwm_duty[] =
+{
+#define PWM_GPIO_DUTY(port_,pin_) 0,    /**< initialise all OFF */
+PWM_GPIOS(PWM_GPIO_DUTY)
+#undef PWM_GPIO_DUTY
+};
+
+/** pwm_task() is in its steady sleep, so must be woken to keep TIMER1 running */
+static bool pwm_bam_steady;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+/* Port value for each bit-plane of two tables, so one can be built while the
+ * other is output, for every port. Those without PWM pins are never used so
+ * the compiler drops them.
+ */
+#define PWM_BAM_PORT_PLANES(port_) static uint8_t pwm_bam_##port_[2][8];
+GPIO_PORTS(PWM_BAM_PORT_PLANES)
+#undef PWM_BAM_PORT_PLANES
+
+#define PWM_BAM_NONE 0xFF   /**< no table pending */
+
+static uint8_t pwm_bam_plane;               /**< next plane to output */
+static volatile uint8_t pwm_bam_active;     /**< table being output */
+static volatile uint8_t pwm_bam_pending;    /**< table to output from the next frame */
+
+/**
+ * @brief Write a bit-plane to the PWM pins of every port, leaving other pins
+ * @param table 0..1
+ * @param plane 0..7
+ */
+static inline void pwm_bam_output(uint8_t table, uint8_t plane)
+{
+#define PWM_BAM_PORT_OUTPUT(port_)                                          \
+    if (GPIO_PORT_MASK(PWM_GPIOS, port_))                                   \
+        GPIO_PORT_UPDATE(port_, GPIO_PORT_MASK(PWM_GPIOS, port_), pwm_bam_##port_[table][plane]);
+GPIO_PORTS(PWM_BAM_PORT_OUTPUT)
+#undef PWM_BAM_PORT_OUTPUT
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+    uint8_t plane = pwm_bam_plane;
+    uint8_t table = pwm_bam_active;
+
+    /* Time the plane before writing the ports, so it lasts the same however
+     * long that takes
+     */
+    PWM_BAM_TIMER_PLANE(plane);
+    pwm_bam_plane = (plane+1) & 7;
+
+    /* Only swap tables between frames */
+    if (plane == 0 && pwm_bam_pending != PWM_BAM_NONE)
+    {
+        table = pwm_bam_active = pwm_bam_pending;
+        pwm_bam_pending = PWM_BAM_NONE;
+    }
+
+    pwm_bam_output(table, plane);
+}
+
+/**
+ * @brief Spread a duty over the bit-planes of one pin
+ * @param planes of the pin's port
+ * @param pin_mask bit of the pin
+ * @param duty 0..255
+ */
+static void pwm_bam_set(uint8_t* planes, uint8_t pin_mask, uint8_t duty)
+{
+    for (uint8_t plane = 0; plane < 8; plane++, duty >>= 1)
+    {
+        if (duty & 1)
+            planes[plane] |= pin_mask;
+        else
+            planes[plane] &= ~pin_mask;
+    }
+}
+
+/**
+ * @brief Work out the bit-planes of every duty
+ * @return table built, which isn't being output
+ */
+static uint8_t pwm_bam_build(void)
+{
+    /* Stop the interrupt taking the spare table while it's rewritten */
+    pwm_bam_pending = PWM_BAM_NONE;
+    uint8_t table = pwm_bam_active ^ 1;
+
+    uint8_t channel = 0;
+#define PWM_GPIO_BAM_SET(port_,pin_)                                        \
+    pwm_bam_set(pwm_bam_##port_[table], 1<<(pin_), pwm_duty[channel]);      \
+    channel++;
+PWM_GPIOS(PWM_GPIO_BAM_SET)
+#undef PWM_GPIO_BAM_SET
+
+    return table;
+}
+
+/**
+ * @brief Output the duties set, from the next frame
+ */
+static void pwm_output(void)
+{
+    pwm_bam_pending = pwm_bam_build();
+    if (pwm_bam_steady)
+    {
+        pwm_bam_steady = false;
+        task_notify(pwm_task);
+    }
+}
+
+#include "pwm_common.h"
+
+static uint8_t pwm_task(uint8_t ms_later)
+{
+    switch(ms_later)
+    {
+    case TASK_STARTUP:
+        /* Enable outputs */
+        PWM_GPIOS(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        pwm_bam_active = pwm_bam_build();
+        pwm_bam_plane = 0;
+        PWM_BAM_TIMER_START();
+        PWM_BAM_TIMER_PLANE(0);
+        pwm_bam_steady = false;
+        return 1;
+
+    case TASK_SHUTDOWN:
+        /* Disable outputs */
+        PWM_BAM_TIMER_STOP();
+        PWM_GPIOS(GPIO_CONFIGURE_UNUSED);
+        return 1;
+
+    default:
+        /* The planes only differ while a channel is dimmed */
+        for (uint8_t channel = 0; channel < sizeof(pwm_duty); channel++)
+        {
+            if (pwm_duty[channel] && pwm_duty[channel] < 255)
+            {
+                pwm_bam_steady = false;
+                task_stay_awake();
+                return PWM_BAM_STEADY_MILLISECONDS;
+            }
+        }
+        pwm_bam_steady = true;
+
+        /* Every plane is the same, so output one of the latest table in
+         * case TIMER1 stops
+         */
+        uint8_t table = pwm_bam_pending;
+        pwm_bam_output((table != PWM_BAM_NONE) ? table : pwm_bam_active, 0);
+        return PWM_BAM_STEADY_MILLISECONDS;
+    }
+}
+
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
+
+#endif /* defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_BAM */
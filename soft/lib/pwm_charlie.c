@@ -0,0 +1,289 @@
+/*! \file pwm_charlie.c
+ *
+ *  \brief Charlieplexed Pulse Width Modulation implementation
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pwm.h"
+#include "gpio.h"
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Select configuration */
+#ifndef PWM_CONFIG
+# define PWM_CONFIG "pwm.config"
+#endif
+
+#include PWM_CONFIG
+
+#if defined(CHARLIE_GPIOS) && PWM_ENGINE == PWM_ENGINE_CHARLIE
+
+/* N charlieplexed pins have an LED between every ordered pair, N*(N-1) in
+ * all. Each frame is a slot per pin, in which that pin is the anode driven
+ * to Vcc and the pins of its LEDs that are ON are cathodes driven to GND.
+ * The rest float, so nothing else can light.
+ *
+ * A slot is split into 8 bit-planes, plane n lasting 2^n units, like
+ * PWM_ENGINE_BAM. A slot lights all of its anode's LEDs together, so every
+ * LED gets the same 1/N of the frame however many are ON, rather than
+ * 1/(N*(N-1)) if they took turns.
+ *
+ * So the anode pin sources the current of up to N-1 LEDs at once, while
+ * each cathode pin sinks just one. Fit a series resistor on every pin that
+ * keeps N-1 LEDs within the anode pin's rating, 40mA absolute maximum on
+ * attiny85/88, bearing in mind each LED's current passes through two of
+ * them.
+ */
+
+#define PWM_CHARLIE_HZ 100                  /**< frame rate */
+#define PWM_CHARLIE_STEADY_MILLISECONDS 64  /**< sleep, as TIMER1 does the work */
+
+/** Number of charlieplexed pins */
+#define PWM_CHARLIE_PINS (0 CHARLIE_GPIOS(PWM_CHARLIE_COUNT))
+#define PWM_CHARLIE_COUNT(port_,pin_) +1
+
+/** Number of ports with charlieplexed pins */
+#define PWM_CHARLIE_PORTS (0 GPIO_PORTS(PWM_CHARLIE_PORT_USED))
+#define PWM_CHARLIE_PORT_USED(port_) + (GPIO_PORT_MASK(CHARLIE_GPIOS, port_) != 0)
+
+/**
+ * @brief CPU cycles in plane 0, 1/255 of a slot
+ * @note plane 0 must outlast its own interrupt, which changes anode on every
+ * port, so slow clocks lower the frame rate. Counting its instructions gives
+ * about 80 cycles plus 25 a port; that's an estimate, not measured, so check
+ * the TIMER1 compare vector in the .lst listing when changing it.
+ */
+#define PWM_CHARLIE_MIN_CYCLES (96 + 32*PWM_CHARLIE_PORTS)
+#define PWM_CHARLIE_UNIT_CYCLES ((F_CPU/(255ul*PWM_CHARLIE_PINS*PWM_CHARLIE_HZ) > PWM_CHARLIE_MIN_CYCLES) \
+                                 ? F_CPU/(255ul*PWM_CHARLIE_PINS*PWM_CHARLIE_HZ) : PWM_CHARLIE_MIN_CYCLES)
+
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+/* 16-bit CTC up to OCR1A at clk/1, doubling the count each plane */
+# define PWM_CHARLIE_TIMER_START() { TCCR1A = 0; TCCR1B = (1<<WGM12) | (1<<CS10); TIMSK1 |= 1<<OCIE1A; }
+# define PWM_CHARLIE_TIMER_STOP() { TIMSK1 &= ~(1<<OCIE1A); TCCR1B = 0; }
+# define PWM_CHARLIE_TIMER_PLANE(plane_) (OCR1A = ((uint16_t)PWM_CHARLIE_UNIT_CYCLES << (plane_)) - 1)
+#else
+/* 8-bit CTC up to OCR1C, doubling the clock divider each plane */
+# define PWM_CHARLIE_CLOCK_SELECT (1 + (PWM_CHARLIE_UNIT_CYCLES > 256) + (PWM_CHARLIE_UNIT_CYCLES > 512) \
+                                     + (PWM_CHARLIE_UNIT_CYCLES > 1024) + (PWM_CHARLIE_UNIT_CYCLES > 2048))
+# define PWM_CHARLIE_TIMER_START() { OCR1C = OCR1A = (PWM_CHARLIE_UNIT_CYCLES >> (PWM_CHARLIE_CLOCK_SELECT-1)) - 1; \
+                                     TIMSK |= 1<<OCIE1A; }
+# define PWM_CHARLIE_TIMER_STOP() { TIMSK &= ~(1<<OCIE1A); TCCR1 = 0; }
+# define PWM_CHARLIE_TIMER_PLANE(plane_) (TCCR1 = (1<<CTC1) | (PWM_CHARLIE_CLOCK_SELECT + (plane_)))
+#endif
+
+/**
+ * Array of duty factors, one per LED. LED anode*(N-1)+n is lit from the anode
+ * pin to the nth of the other pins, in CHARLIE_GPIOS order.
+ */
+static uint8_t pwm_duty[PWM_CHARLIE_PINS*(PWM_CHARLIE_PINS-1)];
+
+/** pwm_task() is in its steady sleep, so must be woken to keep TIMER1 running */
+static bool pwm_charlie_steady;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+/* Bit of each charlieplexed pin on every port, 0 if it's on another. Those
+ * without any are never used so the compiler drops them.
+ */
+#define PWM_CHARLIE_PIN_A(port_, pin_) (GPIO_PORT_SAME(port_, A) << (pin_)),
+#define PWM_CHARLIE_PIN_B(port_, pin_) (GPIO_PORT_SAME(port_, B) << (pin_)),
+#define PWM_CHARLIE_PIN_C(port_, pin_) (GPIO_PORT_SAME(port_, C) << (pin_)),
+#define PWM_CHARLIE_PIN_D(port_, pin_) (GPIO_PORT_SAME(port_, D) << (pin_)),
+#define PWM_CHARLIE_PORT_PINS(port_) \
+    static const uint8_t pwm_charlie_pin_##port_[] = { CHARLIE_GPIOS(PWM_CHARLIE_PIN_##port_) };
+GPIO_PORTS(PWM_CHARLIE_PORT_PINS)
+#undef PWM_CHARLIE_PORT_PINS
+
+/* Pins driven during each bit-plane of each slot, of two tables so one can be
+ * built while the other is output, for every port.
+ */
+#define PWM_CHARLIE_PORT_PLANES(port_) static uint8_t pwm_charlie_##port_[2][PWM_CHARLIE_PINS][8];
+GPIO_PORTS(PWM_CHARLIE_PORT_PLANES)
+#undef PWM_CHARLIE_PORT_PLANES
+
+#define PWM_CHARLIE_NONE 0xFF   /**< no table pending */
+
+static uint8_t pwm_charlie_plane;               /**< next plane to output */
+static uint8_t pwm_charlie_slot;                /**< anode of the next plane */
+static volatile uint8_t pwm_charlie_active;     /**< table being output */
+static volatile uint8_t pwm_charlie_pending;    /**< table to output from the next frame */
+
+ISR(TIMER1_COMPA_vect)
+{
+    uint8_t plane = pwm_charlie_plane;
+    uint8_t slot = pwm_charlie_slot;
+    uint8_t table = pwm_charlie_active;
+
+    /* Time the plane before switching pins, so it lasts the same however
+     * long that takes
+     */
+    PWM_CHARLIE_TIMER_PLANE(plane);
+
+    if (plane == 0)
+    {
+        /* Only swap tables between frames */
+        if (slot == 0 && pwm_charlie_pending != PWM_CHARLIE_NONE)
+        {
+            table = pwm_charlie_active = pwm_charlie_pending;
+            pwm_charlie_pending = PWM_CHARLIE_NONE;
+        }
+
+        /* Change anode with every driven pin at GND, so two are never at
+         * Vcc together and floating pins never have their pull-up on
+         */
+#define PWM_CHARLIE_PORT_GND(port_)                                         \
+        if (GPIO_PORT_MASK(CHARLIE_GPIOS, port_))                           \
+            GPIO_PORT_WRITE(port_, PORT##port_ & ~GPIO_PORT_MASK(CHARLIE_GPIOS, port_));
+GPIO_PORTS(PWM_CHARLIE_PORT_GND)
+#undef PWM_CHARLIE_PORT_GND
+    }
+
+    /* Drive the anode and the cathodes of LEDs ON in this plane */
+#define PWM_CHARLIE_PORT_DRIVE(port_)                                       \
+    if (GPIO_PORT_MASK(CHARLIE_GPIOS, port_))                               \
+        DDR##port_ = (DDR##port_ & ~GPIO_PORT_MASK(CHARLIE_GPIOS, port_))   \
+                     | pwm_charlie_##port_[table][slot][plane];
+GPIO_PORTS(PWM_CHARLIE_PORT_DRIVE)
+#undef PWM_CHARLIE_PORT_DRIVE
+
+    if (plane == 0)
+    {
+#define PWM_CHARLIE_PORT_ANODE(port_)                                       \
+        if (GPIO_PORT_MASK(CHARLIE_GPIOS, port_) && pwm_charlie_pin_##port_[slot]) \
+            GPIO_PORT_WRITE(port_, PORT##port_ | pwm_charlie_pin_##port_[slot]);
+GPIO_PORTS(PWM_CHARLIE_PORT_ANODE)
+#undef PWM_CHARLIE_PORT_ANODE
+    }
+
+    if (++plane >= 8)
+    {
+        plane = 0;
+        if (++slot >= PWM_CHARLIE_PINS)
+            slot = 0;
+        pwm_charlie_slot = slot;
+    }
+    pwm_charlie_plane = plane;
+}
+
+/**
+ * @brief Work out the pins driven in each bit-plane from the duties
+ * @return table built, which isn't being output
+ */
+static uint8_t pwm_charlie_build(void)
+{
+    /* Stop the interrupt taking the spare table while it's rewritten */
+    pwm_charlie_pending = PWM_CHARLIE_NONE;
+    uint8_t table = pwm_charlie_active ^ 1;
+
+    const uint8_t* duty = pwm_duty;
+    for (uint8_t anode = 0; anode < PWM_CHARLIE_PINS; anode++)
+    {
+        /* Anode is always driven, to Vcc */
+        for (uint8_t plane = 0; plane < 8; plane++)
+        {
+#define PWM_CHARLIE_PORT_ANODE(port_)                                       \
+            if (GPIO_PORT_MASK(CHARLIE_GPIOS, port_))                       \
+                pwm_charlie_##port_[table][anode][plane] = pwm_charlie_pin_##port_[anode];
+GPIO_PORTS(PWM_CHARLIE_PORT_ANODE)
+#undef PWM_CHARLIE_PORT_ANODE
+        }
+
+        /* Cathodes are driven, to GND, in the planes of their LED's duty */
+        for (uint8_t cathode = 0; cathode < PWM_CHARLIE_PINS; cathode++)
+        {
+            if (cathode == anode)
+                continue;
+
+            uint8_t bits = *duty++;
+            for (uint8_t plane = 0; plane < 8; plane++, bits >>= 1)
+            {
+                if (bits & 1)
+                {
+#define PWM_CHARLIE_PORT_CATHODE(port_)                                     \
+                    if (GPIO_PORT_MASK(CHARLIE_GPIOS, port_))               \
+                        pwm_charlie_##port_[table][anode][plane] |= pwm_charlie_pin_##port_[cathode];
+GPIO_PORTS(PWM_CHARLIE_PORT_CATHODE)
+#undef PWM_CHARLIE_PORT_CATHODE
+                }
+            }
+        }
+    }
+
+    return table;
+}
+
+/**
+ * @brief Output the duties set, from the next frame
+ */
+static void pwm_output(void)
+{
+    pwm_charlie_pending = pwm_charlie_build();
+    if (pwm_charlie_steady)
+    {
+        pwm_charlie_steady = false;
+        task_notify(pwm_task);
+    }
+}
+
+#include "pwm_common.h"
+
+static uint8_t pwm_task(uint8_t ms_later)
+{
+    switch(ms_later)
+    {
+    case TASK_STARTUP:
+        /* Float every pin until the first plane */
+        CHARLIE_GPIOS(GPIO_CONFIGURE_UNUSED);
+        CHARLIE_GPIOS(GPIO_OUTPUT_GND);
+        pwm_charlie_active = pwm_charlie_build();
+        pwm_charlie_plane = 0;
+        pwm_charlie_slot = 0;
+        PWM_CHARLIE_TIMER_START();
+        PWM_CHARLIE_TIMER_PLANE(0);
+        pwm_charlie_steady = false;
+        return 1;
+
+    case TASK_SHUTDOWN:
+        /* Disable outputs */
+        PWM_CHARLIE_TIMER_STOP();
+        CHARLIE_GPIOS(GPIO_CONFIGURE_UNUSED);
+        CHARLIE_GPIOS(GPIO_OUTPUT_GND);
+        return 1;
+
+    default:
+        /* Even fully ON needs scanning, but with every LED OFF the anode
+         * alone lights nothing, wherever the scan stops
+         */
+        pwm_charlie_steady = true;
+        for (uint8_t channel = 0; channel < sizeof(pwm_duty); channel++)
+        {
+            if (pwm_duty[channel])
+            {
+                pwm_charlie_steady = false;
+                task_stay_awake();
+                break;
+            }
+        }
+        return PWM_CHARLIE_STEADY_MILLISECONDS;
+    }
+}
+
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
+
+#endif /* defined(CHARLIE_GPIOS) && PWM_ENGINE == PWM_ENGINE_CHARLIE */
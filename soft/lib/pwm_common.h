@@ -0,0 +1,116 @@
+/*! \file pwm_common.h
+ *
+ *  \brief Pulse Width Modulation duties and batches, shared by every engine
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Every output engine keeps the duties as set, batches them and copies them
+ * to its pwm_duty[] through any gamma correction the same way, so each
+ * includes this once it has defined pwm_duty[], leaving it only pwm_output()
+ * to define. An engine that doesn't keep channel n at pwm_duty[n] defines
+ * PWM_DUTY_INDEX() first.
+ */
+
+#ifndef PWM_DUTY_INDEX
+/** Index in pwm_duty[] of a channel */
+# define PWM_DUTY_INDEX(channel_) (channel_)
+#endif
+
+/**
+ * Duty factors as set, copied to pwm_duty[] through any gamma correction
+ * when committed
+ */
+static uint8_t pwm_duty_next[sizeof(pwm_duty)];
+
+/** pwm_begin() calls yet to be committed */
+static uint8_t pwm_batch;
+
+/** Duties set since they were last output, bit per byte of pwm_duty[] */
+static uint8_t pwm_changed[(sizeof(pwm_duty)+7)/8];
+
+#ifdef PWM_GAMMA
+/**
+ * Duty factor of each brightness, so it looks linear
+ */
+static const uint8_t pwm_gamma[256] PROGMEM = { PWM_GAMMA_TABLE(PWM_GAMMA) };
+# define PWM_GAMMA_DUTY(brightness_) pgm_read_byte(&pwm_gamma[brightness_])
+#else
+# define PWM_GAMMA_DUTY(brightness_) (brightness_)
+#endif
+
+/**
+ * @brief Output pwm_duty[], by the engine, after some have changed
+ */
+static void pwm_output(void);
+
+/**
+ * @brief Output the duties set
+ */
+static void pwm_update(void)
+{
+    /* Only convert the duties set, one outside a batch */
+    bool changed = false;
+    for (uint8_t byte = 0; byte < sizeof(pwm_changed); byte++)
+    {
+        uint8_t bits = pwm_changed[byte];
+        pwm_changed[byte] = 0;
+        for (uint8_t i = byte*8; bits; i++, bits >>= 1)
+        {
+            if (!(bits & 1))
+                continue;
+            uint8_t duty = PWM_GAMMA_DUTY(pwm_duty_next[i]);
+            if (pwm_duty[i] != duty)
+            {
+                pwm_duty[i] = duty;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed)
+        pwm_output();
+}
+
+void pwm_set(uint8_t channel, uint8_t duty)
+{
+    if (channel < sizeof(pwm_duty))
+    {
+        uint8_t i = PWM_DUTY_INDEX(channel);
+        pwm_duty_next[i] = duty;
+        pwm_changed[i/8] |= 1<<(i%8);
+
+        /* Let whoever's following duties know */
+        if (pwm_set_hook)
+            pwm_set_hook(channel);
+    }
+
+    /* Outside a batch, each duty is output on its own */
+    if (!pwm_batch)
+        pwm_update();
+}
+
+uint8_t pwm_get(uint8_t channel)
+{
+    return (channel < sizeof(pwm_duty)) ? pwm_duty_next[PWM_DUTY_INDEX(channel)] : 0;
+}
+
+void pwm_begin(void)
+{
+    pwm_batch++;
+}
+
+void pwm_commit(void)
+{
+    if (pwm_batch && !--pwm_batch)
+        pwm_update();
+}
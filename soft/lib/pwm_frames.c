@@ -0,0 +1,273 @@
+/*! \file pwm_frames.c
+ *
+ *  \brief Frame table Pulse Width Modulation implementation
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pwm.h"
+#include "gpio.h"
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Select configuration */
+#ifndef PWM_CONFIG
+# define PWM_CONFIG "pwm.config"
+#endif
+
+#include PWM_CONFIG
+
+#if defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_FRAMES
+
+/* Each frame is 255 units. Every channel with a duty switches ON at the
+ * start, then OFF after as many units as its duty. Committing a duty
+ * change works out a table of those edges, and a TIMER1 compare interrupt
+ * replays it, so there's an interrupt per distinct duty and 256 real levels.
+ */
+
+#define PWM_FRAMES_HZ 200                   /**< nominal frame rate */
+#define PWM_FRAMES_STEADY_MILLISECONDS 64   /**< sleep, as TIMER1 does the work */
+
+/**
+ * @brief CPU cycles per unit, 1/255 of a frame
+ * @note the shortest edge must outlast its own interrupt, even when a TIMER0
+ * interrupt has just delayed it, so slow clocks lower the frame rate.
+ * Counting instructions gives about 450 cycles for the scheduler's longest
+ * interrupt, mostly a software 32-bit multiply, and 60 for this one; those
+ * are estimates, not measured, so check both vectors in the .lst listing
+ * when changing them.
+ */
+#define PWM_FRAMES_MIN_CYCLES 512
+#define PWM_FRAMES_UNIT_CYCLES ((F_CPU/(255ul*PWM_FRAMES_HZ) > PWM_FRAMES_MIN_CYCLES) \
+                                ? F_CPU/(255ul*PWM_FRAMES_HZ) : PWM_FRAMES_MIN_CYCLES)
+
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+/* 16-bit CTC up to OCR1A, at the finest divider that fits a whole frame */
+# define PWM_FRAMES_DIVIDER ((PWM_FRAMES_UNIT_CYCLES <= 257) ? 1 : (PWM_FRAMES_UNIT_CYCLES <= 2056) ? 8 : 64)
+# define PWM_FRAMES_CLOCK_SELECT ((PWM_FRAMES_DIVIDER == 1) ? (1<<CS10) \
+                                  : (PWM_FRAMES_DIVIDER == 8) ? (1<<CS11) : ((1<<CS11) | (1<<CS10)))
+# define PWM_FRAMES_TIMER_START() { TCCR1A = 0; TCCR1B = (1<<WGM12) | PWM_FRAMES_CLOCK_SELECT; TIMSK1 |= 1<<OCIE1A; }
+# define PWM_FRAMES_TIMER_STOP() { TIMSK1 &= ~(1<<OCIE1A); TCCR1B = 0; }
+# define PWM_FRAMES_TIMER_COUNTS(counts_) (OCR1A = (counts_) - 1)
+# define PWM_FRAMES_UNIT_COUNTS(units_) ((uint16_t)(units_)*(PWM_FRAMES_UNIT_CYCLES/PWM_FRAMES_DIVIDER))
+typedef uint16_t pwm_frames_counts;
+#else
+/* 8-bit CTC up to OCR1C, at the power of 2 divider nearest below a unit, so
+ * a count is a unit
+ */
+# define PWM_FRAMES_CLOCK_SELECT (8 + (PWM_FRAMES_UNIT_CYCLES >= 256) + (PWM_FRAMES_UNIT_CYCLES >= 512) \
+                                    + (PWM_FRAMES_UNIT_CYCLES >= 1024) + (PWM_FRAMES_UNIT_CYCLES >= 2048))
+# define PWM_FRAMES_TIMER_START() { TCCR1 = (1<<CTC1) | PWM_FRAMES_CLOCK_SELECT; TIMSK |= 1<<OCIE1A; }
+# define PWM_FRAMES_TIMER_STOP() { TIMSK &= ~(1<<OCIE1A); TCCR1 = 0; }
+# define PWM_FRAMES_TIMER_COUNTS(counts_) (OCR1C = OCR1A = (counts_) - 1)
+# define PWM_FRAMES_UNIT_COUNTS(units_) (units_)
+typedef uint8_t pwm_frames_counts;
+#endif
+
+/**
+ * Array of duty factors, initialised to the number of PWM GPIOs configured
+ */
+static uint8_t pwm_duty[] =
+{
+#define PWM_GPIO_DUTY(port_,pin_) 0,    /**< initialise all OFF */
+PWM_GPIOS(PWM_GPIO_DUTY)
+#undef PWM_GPIO_DUTY
+};
+
+/** pwm_task() is in its steady sleep, so must be woken to keep TIMER1 running */
+static bool pwm_frames_steady;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+/**
+ * @brief One edge of a frame
+ */
+struct pwm_frame_edge
+{
+    pwm_frames_counts counts;   /**< TIMER1 counts until the next edge */
+    /* PWM pins of each port from this edge, ports without any take no space */
+#define PWM_FRAME_EDGE_PORT(p_) uint8_t port_##p_[GPIO_PORT_MASK(PWM_GPIOS, p_) ? 1 : 0];
+GPIO_PORTS(PWM_FRAME_EDGE_PORT)
+#undef PWM_FRAME_EDGE_PORT
+};
+
+#define PWM_FRAMES_NONE 0xFF    /**< no table pending */
+
+/**
+ * Two tables, so one can be built while the other is replayed. Each has an
+ * edge at the start and at most one more per channel.
+ */
+static struct pwm_frame_edge pwm_frames[2][sizeof(pwm_duty)+1];
+static uint8_t pwm_frames_edges[2];             /**< edges in each table */
+static volatile uint8_t pwm_frames_active;      /**< table being replayed */
+static volatile uint8_t pwm_frames_pending;     /**< table to replay from the next frame */
+static uint8_t pwm_frames_edge;                 /**< next edge to output */
+static bool pwm_frames_dimmed;                  /**< last build has a channel neither ON nor OFF */
+
+/**
+ * @brief Write an edge to the PWM pins of every port, leaving other pins
+ * @param edge to output
+ */
+static inline void pwm_frames_output(const struct pwm_frame_edge* edge)
+{
+#define PWM_FRAMES_PORT_OUTPUT(p_)                                          \
+    if (GPIO_PORT_MASK(PWM_GPIOS, p_))                                      \
+        GPIO_PORT_UPDATE(p_, GPIO_PORT_MASK(PWM_GPIOS, p_), edge->port_##p_[0]);
+GPIO_PORTS(PWM_FRAMES_PORT_OUTPUT)
+#undef PWM_FRAMES_PORT_OUTPUT
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+    uint8_t index = pwm_frames_edge;
+    uint8_t table = pwm_frames_active;
+
+    /* Only swap tables between frames */
+    if (index == 0 && pwm_frames_pending != PWM_FRAMES_NONE)
+    {
+        table = pwm_frames_active = pwm_frames_pending;
+        pwm_frames_pending = PWM_FRAMES_NONE;
+    }
+
+    /* Time the edge before writing the ports, so the counter can't pass
+     * the comparison first
+     */
+    const struct pwm_frame_edge* edge = &pwm_frames[table][index];
+    PWM_FRAMES_TIMER_COUNTS(edge->counts);
+    pwm_frames_output(edge);
+
+    if (++index >= pwm_frames_edges[table])
+        index = 0;
+    pwm_frames_edge = index;
+}
+
+/**
+ * @brief Work out the edges of a frame from the duties
+ * @return table built, which isn't being replayed
+ */
+static uint8_t pwm_frames_build(void)
+{
+    /* Stop the interrupt taking the spare table while it's rewritten */
+    pwm_frames_pending = PWM_FRAMES_NONE;
+    uint8_t table = pwm_frames_active ^ 1;
+    struct pwm_frame_edge* edge = pwm_frames[table];
+
+    /* Every channel with a duty starts ON */
+    uint8_t channel = 0;
+#define PWM_FRAMES_PORT_ON(port_) uint8_t on_##port_ = 0;
+GPIO_PORTS(PWM_FRAMES_PORT_ON)
+#undef PWM_FRAMES_PORT_ON
+#define PWM_GPIO_FRAMES_ON(port_,pin_)  \
+    if (pwm_duty[channel])              \
+        on_##port_ |= 1<<(pin_);        \
+    channel++;
+PWM_GPIOS(PWM_GPIO_FRAMES_ON)
+#undef PWM_GPIO_FRAMES_ON
+
+    uint8_t at = 0;
+    for (;;)
+    {
+        /* Next edge is the lowest duty still ON, else the end of the frame */
+        uint8_t next = 255;
+        for (channel = 0; channel < sizeof(pwm_duty); channel++)
+        {
+            if (pwm_duty[channel] > at && pwm_duty[channel] < next)
+                next = pwm_duty[channel];
+        }
+
+        edge->counts = PWM_FRAMES_UNIT_COUNTS(next - at);
+#define PWM_FRAMES_PORT_EDGE(p_)                \
+        if (GPIO_PORT_MASK(PWM_GPIOS, p_))      \
+            edge->port_##p_[0] = on_##p_;
+GPIO_PORTS(PWM_FRAMES_PORT_EDGE)
+#undef PWM_FRAMES_PORT_EDGE
+        edge++;
+
+        if (next == 255)
+            break;
+
+        /* Switch OFF every channel with that duty */
+        channel = 0;
+#define PWM_GPIO_FRAMES_OFF(port_,pin_) \
+        if (pwm_duty[channel] == next)  \
+            on_##port_ &= ~(1<<(pin_)); \
+        channel++;
+PWM_GPIOS(PWM_GPIO_FRAMES_OFF)
+#undef PWM_GPIO_FRAMES_OFF
+        at = next;
+    }
+
+    pwm_frames_edges[table] = edge - pwm_frames[table];
+    return table;
+}
+
+/**
+ * @brief Output the duties set, from the next frame
+ */
+static void pwm_output(void)
+{
+    uint8_t table = pwm_frames_build();
+    pwm_frames_pending = table;
+
+    /* A single edge means every channel ON or OFF, so output it now in case
+     * TIMER1 stops
+     */
+    pwm_frames_dimmed = pwm_frames_edges[table] > 1;
+    if (!pwm_frames_dimmed)
+        pwm_frames_output(pwm_frames[table]);
+    else if (pwm_frames_steady)
+    {
+        pwm_frames_steady = false;
+        task_notify(pwm_task);
+    }
+}
+
+#include "pwm_common.h"
+
+static uint8_t pwm_task(uint8_t ms_later)
+{
+    switch(ms_later)
+    {
+    case TASK_STARTUP:
+        /* Enable outputs, replaying the table from the first edge */
+        PWM_GPIOS(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        pwm_frames_active = pwm_frames_build();
+        pwm_frames_dimmed = pwm_frames_edges[pwm_frames_active] > 1;
+        pwm_frames_edge = 0;
+        PWM_FRAMES_TIMER_START();
+        PWM_FRAMES_TIMER_COUNTS(1);
+        pwm_frames_steady = false;
+        return 1;
+
+    case TASK_SHUTDOWN:
+        /* Disable outputs */
+        PWM_FRAMES_TIMER_STOP();
+        PWM_GPIOS(GPIO_CONFIGURE_UNUSED);
+        return 1;
+
+    default:
+        /* A single edge is output already, more need TIMER1 to replay them */
+        pwm_frames_steady = !pwm_frames_dimmed;
+        if (pwm_frames_dimmed)
+            task_stay_awake();
+        return PWM_FRAMES_STEADY_MILLISECONDS;
+    }
+}
+
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
+
+#endif /* defined(PWM_GPIOS) && PWM_ENGINE == PWM_ENGINE_FRAMES */
@@ -0,0 +1,262 @@
+/*! \file pwm_shift.c
+ *
+ *  \brief Shift register Pulse Width Modulation implementation
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pwm.h"
+#include "gpio.h"
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Select configuration */
+#ifndef PWM_CONFIG
+# define PWM_CONFIG "pwm.config"
+#endif
+
+#include PWM_CONFIG
+
+#if defined(SHIFT_CHANNELS) && PWM_ENGINE == PWM_ENGINE_SHIFT
+
+/* Channels are the outputs of a chain of 74HC595 shift registers, clocked by
+ * the USI in three-wire mode from DO to SER and USCK to SRCLK, with every
+ * RCLK on SHIFT_LATCH_GPIO. Channel n is output Q(n%8) of register n/8,
+ * counting from the one wired to DO.
+ *
+ * Each frame is split into 8 bit-planes, plane n lasting 2^n units, like
+ * PWM_ENGINE_BAM. A TIMER1 interrupt shifts bit n of every duty into the
+ * chain then latches it, so a frame is 8 interrupts however many channels
+ * there are. The registers hold their outputs while the CPU sleeps.
+ */
+
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+# error "PWM_ENGINE_SHIFT needs a USI, which attiny48/88 lack"
+#endif
+
+#if !SHIFT_CHANNELS || SHIFT_CHANNELS % 8 || SHIFT_CHANNELS > 248
+# error "SHIFT_CHANNELS must be a multiple of 8, up to 248"
+#endif
+
+#define PWM_SHIFT_HZ 200                    /**< frame rate */
+#define PWM_SHIFT_STEADY_MILLISECONDS 64    /**< sleep, as TIMER1 does the work */
+#define PWM_SHIFT_LATCH_MILLISECONDS (1000/PWM_SHIFT_HZ + 1) /**< sleep until a pending table is latched */
+
+/** Registers in the chain, a byte each */
+#define PWM_SHIFT_BYTES (SHIFT_CHANNELS/8)
+
+/**
+ * @brief CPU cycles in plane 0, 1/255 of a frame
+ * @note plane 0 must outlast its own interrupt, which shifts out every byte,
+ * so slow clocks and long chains lower the frame rate. Counting its
+ * instructions gives about 100 cycles plus 44 a byte; that's an estimate,
+ * not measured, so check __vector_3 in the .lst listing when changing it.
+ */
+#define PWM_SHIFT_MIN_CYCLES (128 + 48*PWM_SHIFT_BYTES)
+#define PWM_SHIFT_UNIT_CYCLES ((F_CPU/(255ul*PWM_SHIFT_HZ) > PWM_SHIFT_MIN_CYCLES) \
+                               ? F_CPU/(255ul*PWM_SHIFT_HZ) : PWM_SHIFT_MIN_CYCLES)
+
+/* 8-bit CTC up to OCR1C, doubling the clock divider each plane */
+#define PWM_SHIFT_CLOCK_SELECT (1 + (PWM_SHIFT_UNIT_CYCLES > 256) + (PWM_SHIFT_UNIT_CYCLES > 512) \
+                                  + (PWM_SHIFT_UNIT_CYCLES > 1024) + (PWM_SHIFT_UNIT_CYCLES > 2048))
+#define PWM_SHIFT_TIMER_START() { OCR1C = OCR1A = (PWM_SHIFT_UNIT_CYCLES >> (PWM_SHIFT_CLOCK_SELECT-1)) - 1; \
+                                  TIMSK |= 1<<OCIE1A; }
+#define PWM_SHIFT_TIMER_STOP() { TIMSK &= ~(1<<OCIE1A); TCCR1 = 0; }
+#define PWM_SHIFT_TIMER_PLANE(plane_) (TCCR1 = (1<<CTC1) | (PWM_SHIFT_CLOCK_SELECT + (plane_)))
+
+/** USI three-wire outputs, DO and USCK */
+#define PWM_SHIFT_USI_GPIOS(_) _(B, 1) _(B, 2)
+
+/* Each USITC strobe toggles USCK. The rising edge clocks DO into the chain
+ * and the falling edge's USICLK strobe shifts the next bit onto DO, so a byte
+ * is 16 writes, MSB first.
+ */
+#define PWM_SHIFT_USCK_RISE ((1<<USIWM0) | (1<<USITC))
+#define PWM_SHIFT_USCK_FALL ((1<<USIWM0) | (1<<USITC) | (1<<USICLK))
+
+/**
+ * Array of duty factors, one per shift register output
+ */
+static uint8_t pwm_duty[SHIFT_CHANNELS];
+
+/** pwm_task() is in its steady sleep, so must be woken to keep TIMER1 running */
+static bool pwm_shift_steady;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+/**
+ * Bytes shifted out for each bit-plane of two tables, so one can be built
+ * while the other is output. The far end of the chain goes first.
+ */
+static uint8_t pwm_shift_planes[2][8][PWM_SHIFT_BYTES];
+
+#define PWM_SHIFT_NONE 0xFF     /**< no table pending */
+
+static uint8_t pwm_shift_plane;             /**< next plane to output */
+static volatile uint8_t pwm_shift_active;   /**< table being output */
+static volatile uint8_t pwm_shift_pending;  /**< table to output from the next frame */
+
+/**
+ * @brief Shift bytes into the chain and latch them onto the outputs
+ * @param bytes one per register, far end first
+ */
+static void pwm_shift_output(const uint8_t* bytes)
+{
+    for (uint8_t i = 0; i < PWM_SHIFT_BYTES; i++)
+    {
+        USIDR = bytes[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            USICR = PWM_SHIFT_USCK_RISE;
+            USICR = PWM_SHIFT_USCK_FALL;
+        }
+    }
+
+    /* RCLK rising edge copies the chain to the outputs */
+#define PWM_SHIFT_LATCH(port_, pin_)                                        \
+    GPIO_PORT_WRITE(port_, PORT##port_ | (1<<(pin_)));                      \
+    GPIO_PORT_WRITE(port_, PORT##port_ & ~(1<<(pin_)));
+SHIFT_LATCH_GPIO(PWM_SHIFT_LATCH)
+#undef PWM_SHIFT_LATCH
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+    /* Time the plane before shifting it out, so it isn't stretched by
+     * however long that takes. Every latch then comes the same time after
+     * its comparison and the planes keep their binary weights.
+     */
+    uint8_t plane = pwm_shift_plane;
+    PWM_SHIFT_TIMER_PLANE(plane);
+    pwm_shift_plane = (plane+1) & 7;
+
+    uint8_t table = pwm_shift_active;
+
+    /* Only swap tables between frames */
+    if (plane == 0 && pwm_shift_pending != PWM_SHIFT_NONE)
+    {
+        table = pwm_shift_active = pwm_shift_pending;
+        pwm_shift_pending = PWM_SHIFT_NONE;
+    }
+
+    pwm_shift_output(pwm_shift_planes[table][plane]);
+}
+
+/**
+ * @brief Work out the bit-planes of every duty
+ * @return table built, which isn't being output
+ */
+static uint8_t pwm_shift_build(void)
+{
+    /* Stop the interrupt taking the spare table while it's rewritten */
+    pwm_shift_pending = PWM_SHIFT_NONE;
+    uint8_t table = pwm_shift_active ^ 1;
+
+    for (uint8_t plane = 0; plane < 8; plane++)
+    {
+        uint8_t* bytes = pwm_shift_planes[table][plane];
+        const uint8_t* duty = pwm_duty;
+        for (uint8_t i = PWM_SHIFT_BYTES; i--; )
+        {
+            uint8_t byte = 0;
+            for (uint8_t output = 0; output < 8; output++)
+            {
+                if ((*duty++ >> plane) & 1)
+                    byte |= 1<<output;
+            }
+            bytes[i] = byte;
+        }
+    }
+
+    return table;
+}
+
+/**
+ * @brief Output the duties set, from the next frame
+ */
+static void pwm_output(void)
+{
+    pwm_shift_pending = pwm_shift_build();
+    if (pwm_shift_steady)
+    {
+        pwm_shift_steady = false;
+        task_notify(pwm_task);
+    }
+}
+
+#include "pwm_common.h"
+
+static uint8_t pwm_task(uint8_t ms_later)
+{
+    switch(ms_later)
+    {
+    case TASK_STARTUP:
+        /* Enable outputs, USCK idling low */
+        PWM_SHIFT_USI_GPIOS(GPIO_OUTPUT_GND);
+        PWM_SHIFT_USI_GPIOS(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        SHIFT_LATCH_GPIO(GPIO_OUTPUT_GND);
+        SHIFT_LATCH_GPIO(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        USICR = 1<<USIWM0;
+        pwm_shift_active = pwm_shift_build();
+        pwm_shift_plane = 0;
+        PWM_SHIFT_TIMER_START();
+        PWM_SHIFT_TIMER_PLANE(0);
+        pwm_shift_steady = false;
+        return 1;
+
+    case TASK_SHUTDOWN:
+        /* The registers would hold their outputs, so turn them all OFF */
+        PWM_SHIFT_TIMER_STOP();
+        {
+            static const uint8_t off[PWM_SHIFT_BYTES];
+            pwm_shift_output(off);
+        }
+
+        /* Disable outputs */
+        USICR = 0;
+        SHIFT_LATCH_GPIO(GPIO_CONFIGURE_UNUSED);
+        PWM_SHIFT_USI_GPIOS(GPIO_CONFIGURE_UNUSED);
+        return 1;
+
+    default:
+        /* Every plane is the same unless a channel is dimmed, and the
+         * registers hold whichever was latched last, so then only wait for
+         * the latest table to be latched
+         */
+        for (uint8_t channel = 0; channel < sizeof(pwm_duty); channel++)
+        {
+            if (pwm_duty[channel] && pwm_duty[channel] < 255)
+            {
+                pwm_shift_steady = false;
+                task_stay_awake();
+                return PWM_SHIFT_STEADY_MILLISECONDS;
+            }
+        }
+        if (pwm_shift_pending != PWM_SHIFT_NONE)
+        {
+            pwm_shift_steady = false;
+            task_stay_awake();
+            return PWM_SHIFT_LATCH_MILLISECONDS;
+        }
+        pwm_shift_steady = true;
+        return PWM_SHIFT_STEADY_MILLISECONDS;
+    }
+}
+
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
+
+#endif /* defined(SHIFT_CHANNELS) && PWM_ENGINE == PWM_ENGINE_SHIFT */
@@ -0,0 +1,249 @@
+/*! \file pwm_ws2812.c
+ *
+ *  \brief Addressable LED strip output implementation
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pwm.h"
+#include "gpio.h"
+#include "task.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+/* Select configuration */
+#ifndef PWM_CONFIG
+# define PWM_CONFIG "pwm.config"
+#endif
+
+#include PWM_CONFIG
+
+#if defined(WS2812_LEDS) && PWM_ENGINE == PWM_ENGINE_WS2812
+
+/* A WS2812 strip takes 24 bits per LED, green, red then blue, MSB first, as
+ * pulses on one wire: every bit starts with a rising edge, and is 1 if the
+ * pulse is long. Each LED keeps the first 24 bits for itself and passes the
+ * rest along, then they all output what they've got once the wire stays low.
+ *
+ * So the strip holds its colours without any help. Committed duties are
+ * streamed from pwm_task() once, with interrupts off to keep the timing.
+ * At 1.25us a bit the longest strip holds them off for 2.55ms, which the
+ * scheduler tolerates by accounting the milliseconds it missed (up to
+ * TIMER_MAX_ms in task.c).
+ */
+
+#if WS2812_LEDS*3 > 255
+# error "WS2812_LEDS must be 85 or fewer"
+#endif
+
+#define PWM_WS2812_IDLE_MILLISECONDS 250    /**< sleep, as the strip needs nothing until duties change */
+
+/**
+ * @brief CPU cycles nearest some nanoseconds
+ * @param f_cpu_ clock frequency
+ * @param ns_ nanoseconds
+ */
+#define PWM_WS2812_CYCLES(f_cpu_, ns_) (((f_cpu_)/1000ul*(ns_) + 500000ul) / 1000000ul)
+
+/* Targets within both WS2812 and WS2812B tolerances */
+#define PWM_WS2812_T0H(f_cpu_) PWM_WS2812_CYCLES(f_cpu_, 375)      /**< cycles high for a 0 */
+#define PWM_WS2812_T1H(f_cpu_) PWM_WS2812_CYCLES(f_cpu_, 750)      /**< cycles high for a 1 */
+#define PWM_WS2812_BIT(f_cpu_) PWM_WS2812_CYCLES(f_cpu_, 1250)     /**< cycles per bit */
+
+/* Padding between the instructions of pwm_ws2812_send(), which take
+ * T0H = 2 + D1, T1H = 4 + D1 + D2 and BIT = 8 + D1 + D2 + D3 cycles
+ */
+#define PWM_WS2812_D1(f_cpu_) (PWM_WS2812_T0H(f_cpu_) - 2)
+#define PWM_WS2812_D2(f_cpu_) (PWM_WS2812_T1H(f_cpu_) - PWM_WS2812_T0H(f_cpu_) - 2)
+#define PWM_WS2812_D3(f_cpu_) (PWM_WS2812_BIT(f_cpu_) - PWM_WS2812_T1H(f_cpu_) - 4)
+
+#if F_CPU < 8000000UL
+# error "PWM_ENGINE_WS2812 needs at least an 8MHz clock"
+#endif
+
+/* Port and pin bit of the strip's data GPIO */
+#define PWM_WS2812_PORT_OF(port_, pin_) PORT##port_
+#define PWM_WS2812_PIN_OF(port_, pin_) (1<<(pin_))
+#define PWM_WS2812_PORT WS2812_GPIO(PWM_WS2812_PORT_OF)
+#define PWM_WS2812_PIN WS2812_GPIO(PWM_WS2812_PIN_OF)
+
+/**
+ * Frame buffer of duty factors, in the order they're streamed: green, red
+ * then blue of each LED
+ */
+static uint8_t pwm_duty[WS2812_LEDS*3];
+
+/** pwm_duty[] has changed since it was last streamed */
+static bool pwm_ws2812_changed;
+
+static uint8_t pwm_task(uint8_t ms_later);
+
+#ifndef TEST
+
+/**
+ * @brief Stream the frame buffer to the strip
+ * @note interrupts must be off, and the strip's data GPIO low long enough
+ * since the last time for it to latch, 280us for a WS2812B
+ */
+static void pwm_ws2812_send(void)
+{
+    const uint8_t* next = pwm_duty;
+    uint8_t count = sizeof(pwm_duty);
+    uint8_t high = PWM_WS2812_PORT | PWM_WS2812_PIN;
+    uint8_t low = PWM_WS2812_PORT & ~PWM_WS2812_PIN;
+    uint8_t byte, bits;
+
+    /* Cycles taken are in brackets, and the bit's level changes the cycle
+     * after each OUT
+     */
+    asm volatile(
+        "1:   ld   %[byte], %a[next]+   \n\t"   /* [2] */
+        "     ldi  %[bits], 8           \n\t"   /* [1] */
+        "2:   out  %[port], %[high]     \n\t"   /* [1] rising edge */
+        "     .rept %[d1]               \n\t"   /* [D1] */
+        "     nop                       \n\t"
+        "     .endr                     \n\t"
+        "     sbrs %[byte], 7           \n\t"   /* [1] or [2] skipping a 1 */
+        "     out  %[port], %[low]      \n\t"   /* [1] end of a 0 */
+        "     lsl  %[byte]              \n\t"   /* [1] */
+        "     .rept %[d2]               \n\t"   /* [D2] */
+        "     nop                       \n\t"
+        "     .endr                     \n\t"
+        "     out  %[port], %[low]      \n\t"   /* [1] end of a 1 */
+        "     .rept %[d3]               \n\t"   /* [D3] */
+        "     nop                       \n\t"
+        "     .endr                     \n\t"
+        "     dec  %[bits]              \n\t"   /* [1] */
+        "     brne 2b                   \n\t"   /* [2] or [1] after bit 0 */
+        "     dec  %[count]             \n\t"   /* [1] */
+        "     brne 1b                   \n\t"   /* [2] or [1] when done */
+        : [next] "+e" (next), [count] "+r" (count), [byte] "=&r" (byte), [bits] "=&d" (bits)
+        : [port] "I" (_SFR_IO_ADDR(PWM_WS2812_PORT)), [high] "r" (high), [low] "r" (low),
+          [d1] "I" (PWM_WS2812_D1(F_CPU)), [d2] "I" (PWM_WS2812_D2(F_CPU)), [d3] "I" (PWM_WS2812_D3(F_CPU))
+        : "memory"
+    );
+}
+
+#else
+
+/** Tells the test each instruction's cycles, after its level is output */
+void mock_ws2812_cycles(uint8_t cycles);
+
+/**
+ * @brief Stream the frame buffer, running the same instructions in C
+ */
+static void pwm_ws2812_send(void)
+{
+    const uint8_t* next = pwm_duty;
+    uint8_t count = sizeof(pwm_duty);
+    uint8_t high = PWM_WS2812_PORT | PWM_WS2812_PIN;
+    uint8_t low = PWM_WS2812_PORT & ~PWM_WS2812_PIN;
+
+    do
+    {
+        uint8_t byte = *next++;                     mock_ws2812_cycles(2);
+        uint8_t bits = 8;                           mock_ws2812_cycles(1);
+        do
+        {
+            PWM_WS2812_PORT = high;                 mock_ws2812_cycles(1);
+                                                    mock_ws2812_cycles(PWM_WS2812_D1(F_CPU));
+            if (!(byte & 0x80))
+            {
+                                                    mock_ws2812_cycles(1);
+                PWM_WS2812_PORT = low;              mock_ws2812_cycles(1);
+            }
+            else
+                                                    mock_ws2812_cycles(2);
+            byte <<= 1;                             mock_ws2812_cycles(1);
+                                                    mock_ws2812_cycles(PWM_WS2812_D2(F_CPU));
+            PWM_WS2812_PORT = low;                  mock_ws2812_cycles(1);
+                                                    mock_ws2812_cycles(PWM_WS2812_D3(F_CPU));
+            bits--;                                 mock_ws2812_cycles(1);
+                                                    mock_ws2812_cycles(bits ? 2 : 1);
+        } while (bits);
+        count--;                                    mock_ws2812_cycles(1);
+                                                    mock_ws2812_cycles(count ? 2 : 1);
+    } while (count);
+}
+
+#endif /* TEST */
+
+/**
+ * @brief Frame buffer position of a channel
+ * @param channel red, green and blue of each LED in turn
+ * @return index in pwm_duty[]
+ */
+static inline uint8_t pwm_ws2812_index(uint8_t channel)
+{
+    /* Swap red and green */
+    uint8_t colour = channel % 3;
+    return channel + (colour == 0) - (colour == 1);
+}
+
+/** Index in pwm_duty[] of a channel, for pwm_common.h */
+#define PWM_DUTY_INDEX(channel_) pwm_ws2812_index(channel_)
+
+/**
+ * @brief Stream the duties set, from pwm_task()
+ */
+static void pwm_output(void)
+{
+    pwm_ws2812_changed = true;
+    task_notify(pwm_task);
+}
+
+#include "pwm_common.h"
+
+static uint8_t pwm_task(uint8_t ms_later)
+{
+    switch(ms_later)
+    {
+    case TASK_STARTUP:
+        /* Enable output, low so the strip's ready by the first cycle */
+        WS2812_GPIO(GPIO_OUTPUT_GND);
+        WS2812_GPIO(GPIO_CONFIGURE_DIGITAL_OUTPUT);
+        pwm_update();
+        pwm_ws2812_changed = true;
+        return 1;
+
+    case TASK_SHUTDOWN:
+        /* The strip would hold its colours, so turn every LED OFF */
+        for (uint8_t i = 0; i < sizeof(pwm_duty); i++)
+            pwm_duty[i] = 0;
+        cli();
+        pwm_ws2812_send();
+        sei();
+
+        /* Disable output */
+        WS2812_GPIO(GPIO_CONFIGURE_UNUSED);
+        return 1;
+
+    default:
+        /* Cycles are milliseconds apart, time for the strip to latch */
+        if (pwm_ws2812_changed)
+        {
+            pwm_ws2812_changed = false;
+            cli();
+            pwm_ws2812_send();
+            sei();
+        }
+        return PWM_WS2812_IDLE_MILLISECONDS;
+    }
+}
+
+/* Last, so duties set by other tasks are output in the same cycle */
+TASK_DECLARE_PRIORITY(pwm_task, 90);
+
+#endif /* defined(WS2812_LEDS) && PWM_ENGINE == PWM_ENGINE_WS2812 */
@@ -16,88 +16,649 @@
 
 #include "task.h"
 
-#if !defined(TEST) && 0
+#if !defined(TEST) && defined(CPU_PROFILE)
 # include "../inc/gpio.h"
 # define CPU_PROFILE_GPIO(_) _(B,0) /**< Profile CPU activity on pin B0 */
 #else
 # define CPU_PROFILE_GPIO(_) /* do nothing */
 #endif
 
+/* Call tasks directly instead of through the linker's task list */
+#if defined(TASK_STATIC)
+# define TASK_STATIC_CALLS 1
+#else
+# define TASK_STATIC_CALLS 0
+#endif
+
+/* Profile CPU time of each task */
+#if defined(TASK_PROFILE)
+# define TASK_PROFILING 1
+#else
+# define TASK_PROFILING 0
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <avr/wdt.h>
+#if TASK_PROFILING
+# include <avr/eeprom.h>
+#endif
 
-static volatile uint8_t task_ticks; /**< increments each millisecond */
+/**
+ * @brief TIMER0 clock divider, the coarsest that still resolves 1ms
+ * @note the timer is reprogrammed for each sleep, so a coarse clock means
+ *       fewer compare interrupts for the same sleep
+ */
+#define TIMER_PRESCALE ((F_CPU >= 1024000u) ? 1024u \
+                      : (F_CPU >= 256000u) ? 256u  \
+                      : (F_CPU >= 64000u) ? 64u : 8u)
+#define TIMER_CLOCK_SELECT ((F_CPU >= 1024000u) ? 0x05 \
+                          : (F_CPU >= 256000u) ? 0x04  \
+                          : (F_CPU >= 64000u) ? 0x03 : 0x02)
+
+#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
+# define TIMER_CLOCK(select_) (TCCR0A = (select_))  /**< free running */
+# define TIMER_FLAGS TIFR0
+# define WDT_CONTROL WDTCSR
+#else
+# define TIMER_CLOCK(select_) (TCCR0B = (select_))
+# define TIMER_FLAGS TIFR
+# define WDT_CONTROL WDTCR
+#endif
+
+#if !defined(TEST) && (F_CPU % 1000)
+# error "F_CPU must be a whole number of kHz for millisecond timing"
+#endif
+
+/* A 1ms comparison must be at least one count, or it waits a whole turn */
+#if !defined(TEST) && (F_CPU/1000 < TIMER_PRESCALE)
+# error "F_CPU is too slow for TIMER0 to time 1ms"
+#endif
 
 /**
- * @brief Calculate the number of F_CPU/256 ticks in 2ms, rounding up
+ * @brief Longest whole number of milliseconds the 8-bit counter can time,
+ *        short of a whole turn so the comparison is never where it starts
+ * @note also how long interrupts can be held off, e.g. by a long cli(),
+ *       without losing time
  */
-#define TIMER_SYSCLK_256_2ms ((F_CPU+64000)/128000)
+#define TIMER_MAX_ms \
+    (((255ul*TIMER_PRESCALE*1000u)/F_CPU) < UINT8_MAX ? \
+     (uint8_t)((255ul*TIMER_PRESCALE*1000u)/F_CPU) : UINT8_MAX)
+
+static volatile uint16_t task_ticks;    /**< free running millisecond count */
+static volatile uint16_t task_wake;     /**< task_ticks at which to end delay */
+static uint16_t task_last_wake;         /**< task_ticks at which last delay ended */
+static volatile uint8_t task_chunk;     /**< milliseconds timed by the pending compare */
+static volatile uint8_t task_chunk_start; /**< TCNT0 at which the pending compare's chunk started */
+static uint16_t task_residue;           /**< F_CPU cycles not yet timed by a compare */
+static uint16_t task_chunk_residue;     /**< task_residue before the pending compare */
+static volatile uint8_t task_wdt_ms;    /**< milliseconds timed by the pending watchdog */
+static volatile bool task_notified;     /**< task_notify() called since last wake */
+static uint8_t task_awake;              /**< tasks that called task_stay_awake() when last called */
+#if TASK_PROFILING
+static uint32_t task_profile_counts;    /**< TIMER0 counts up to the last compare */
+#endif
+
+/**
+ * @brief Shortest watchdog period, so the least time worth powering down for
+ */
+#define WDT_MIN_ms 16u
+
+/**
+ * @brief Longest watchdog period, as a WDP2:0 prescaler (2s)
+ */
+#define WDT_MAX_PRESCALE 7u
+
+/**
+ * @brief Set the timer comparison for the next wake time, chaining several
+ *        comparisons if it is further away than the counter can reach
+ */
+static void task_timer_program(void)
+{
+    /* TIMER0 runs freely, so the chunk starts at the comparison that just
+     * matched however late this is. Whole milliseconds the counter has
+     * already passed, while interrupts were held off, are accounted now and
+     * the chunk starts at the last of them.
+     */
+    uint8_t start = OCR0A;
+    for (;;)
+    {
+        uint16_t ms_cycles = F_CPU/1000u + task_residue;
+        uint8_t ms_counts = ms_cycles/TIMER_PRESCALE;
+        if ((uint8_t)(TCNT0 - start) < ms_counts)
+            break;
+        start += ms_counts;
+        task_residue = ms_cycles % TIMER_PRESCALE;
+        task_ticks++;
+    }
+#if TASK_PROFILING
+    task_profile_counts += (uint8_t)(start - OCR0A);
+#endif
+
+    /* Time a whole number of milliseconds, or just 1 while tasks are running
+     * and the next wake time isn't known yet
+     */
+    int16_t remaining = task_wake - task_ticks;
+    uint8_t chunk = (remaining <= 0) ? 1
+                  : (remaining > TIMER_MAX_ms) ? TIMER_MAX_ms
+                  : (uint8_t)remaining;
+
+    /* Bresenham: the fraction of a timer count that can't be programmed is
+     * carried into the next comparison, so on average every millisecond is
+     * exactly F_CPU/1000 cycles long
+     */
+    task_chunk_residue = task_residue;
+    uint32_t cycles = (uint32_t)chunk*(F_CPU/1000u) + task_residue;
+
+    /* A comparison the counter is about to reach may be missed and wait a
+     * whole turn, so time a millisecond more instead
+     */
+    uint8_t elapsed = TCNT0 - start;
+    while (chunk < TIMER_MAX_ms && cycles < ((uint16_t)elapsed+2)*(uint32_t)TIMER_PRESCALE)
+    {
+        chunk++;
+        cycles += F_CPU/1000u;
+    }
+    task_chunk_start = start;
+    OCR0A = start + (uint8_t)(cycles/TIMER_PRESCALE);
+    task_residue = cycles % TIMER_PRESCALE;
+    task_chunk = chunk;
+}
+
+/**
+ * @brief Bring the pending comparison forward to the first whole millisecond
+ *        TIMER0 hasn't yet reached, and end the delay there
+ * @note called with interrupts disabled
+ */
+static void task_timer_cut_short(void)
+{
+    /* Count whole milliseconds of the pending comparison until comfortably
+     * ahead of the counter, which keeps counting while we do this
+     */
+    uint8_t elapsed = TCNT0 - task_chunk_start;
+    uint8_t chunk = 1;
+    uint32_t cycles = F_CPU/1000u + task_chunk_residue;
+    while (chunk < task_chunk && cycles < ((uint16_t)elapsed+2)*(uint32_t)TIMER_PRESCALE)
+    {
+        chunk++;
+        cycles += F_CPU/1000u;
+    }
+    if (chunk < task_chunk)
+    {
+        OCR0A = task_chunk_start + (uint8_t)(cycles/TIMER_PRESCALE);
+        task_residue = cycles % TIMER_PRESCALE;
+        task_chunk = chunk;
+    }
+    task_wake = task_ticks + task_chunk;
+}
 
 /**
  * @brief Timer0 comparison interrupt handler
  */
 ISR (TIMER0_COMPA_vect)
 {
-    /* Count ticks of timer comparison */
-    TCNT0 = 0;
-
-    /* Modulate comparison to give /128 resolution */
-#if TIMER_SYSCLK_256_2ms % 2
-    OCR0A ^= 1;
+    /* Account for the time, the next chunk starts from here */
+    task_ticks += task_chunk;
+#if TASK_PROFILING
+    task_profile_counts += (uint8_t)(OCR0A - task_chunk_start);
 #endif
+    task_timer_program();
+}
+
+/**
+ * @brief Watchdog interrupt handler
+ */
+ISR (WDT_vect)
+{
+    /* TIMER0 was paused so the watchdog period is all the time that passed */
+    task_ticks += task_wdt_ms;
+    task_wdt_ms = 0;
+    WDT_CONTROL = 1<<WDIF;  /* WDE is already clear, so this just stops interrupts */
+}
+
+/**
+ * @brief Power down until the watchdog interrupt, if there is time enough
+ * @param milliseconds available before the pending comparison must be timed
+ * @return true if powered down, false if there wasn't time, a task must stay
+ *         awake or TIMER0 is due
+ * @note the watchdog oscillator is only accurate to a few percent, so long
+ *       sleeps trade some timing accuracy for much less current
+ * @note the watchdog can't be read, so being woken early by task_notify()
+ *       is taken to be half way through its period
+ * @note called and returns with interrupts disabled
+ */
+static bool task_power_down(int16_t milliseconds)
+{
+    if (task_awake || milliseconds < (int16_t)WDT_MIN_ms)
+        return false;
+
+    /* Longest watchdog period that fits */
+    uint8_t prescale = 0;
+    while (prescale < WDT_MAX_PRESCALE && (int16_t)(WDT_MIN_ms<<(prescale+1)) <= milliseconds)
+        prescale++;
+
+    /* TIMER0 would stop anyway, but pause it now so a comparison can't
+     * be missed between here and sleep_cpu()
+     */
+    TIMER_CLOCK(0);
+    bool powered_down = !(TIMER_FLAGS & (1<<OCF0A));
+    if (powered_down)
+    {
+        task_wdt_ms = WDT_MIN_ms<<prescale;
+        wdt_reset();
+        WDT_CONTROL = (1<<WDCE) | (1<<WDE);
+        WDT_CONTROL = (1<<WDIF) | (1<<WDIE) | (prescale<<WDP0);
 
-    task_ticks++;
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        while (task_wdt_ms && !task_notified)
+        {
+            CPU_PROFILE_GPIO(GPIO_OUTPUT_GND);
+            sei();
+            sleep_cpu();
+            cli();
+            CPU_PROFILE_GPIO(GPIO_OUTPUT_Vcc);
+        }
+        set_sleep_mode(SLEEP_MODE_IDLE);
+
+        if (task_wdt_ms)
+        {
+            WDT_CONTROL = 1<<WDIF;
+            task_ticks += task_wdt_ms/2;
+            task_wdt_ms = 0;
+        }
+    }
+    TIMER_CLOCK(TIMER_CLOCK_SELECT);
+
+    return powered_down;
 }
 
 /**
- * @brief Sleep the processor for a short period
- * @param milliseconds to sleep
+ * @brief Longest delay, so the signed comparisons with task_ticks still work
+ */
+#define TASK_DELAY_MAX_ms ((uint16_t)INT16_MAX)
+
+/**
+ * @brief Sleep the processor until some time after the last wake
+ * @param milliseconds to sleep since the last wake, up to TASK_DELAY_MAX_ms
+ * @return milliseconds actually elapsed since the last wake, including any
+ *         time overrun by tasks or the final comparison
  */
-static void task_delay(uint8_t milliseconds)
+static uint16_t task_delay(uint16_t milliseconds)
 {
-    while (task_ticks < milliseconds)
+    cli();
+    task_wake = task_last_wake + (task_notified ? 1 : milliseconds);
+
+    /* Interrupts stay off while testing, so the final comparison can't
+     * sneak in between the test and sleep_cpu() and leave us waiting
+     */
+    int16_t remaining;
+    while ((remaining = task_wake - task_ticks) > 0)
     {
+        /* Notified tasks are run at the next millisecond */
+        if (task_notified)
+            task_timer_cut_short();
+
+        /* Power down for long sleeps, leaving TIMER0 to finish off */
+        else if (task_power_down(remaining - task_chunk))
+            continue;
+
         CPU_PROFILE_GPIO(GPIO_OUTPUT_GND);
+        sei();  /* sleep_cpu() always executes before a pending interrupt */
         sleep_cpu();
+        cli();
         CPU_PROFILE_GPIO(GPIO_OUTPUT_Vcc);
     }
 
-    /* Reset timer on exit so next delay is aligned to this time */
-    task_ticks = 0;
+    /* Next delay is measured from now, not from when tasks finish */
+    uint16_t elapsed = task_ticks - task_last_wake;
+    task_last_wake = task_ticks;
+    task_notified = false;
+    sei();
+
+    return (elapsed < TASK_STARTUP16) ? elapsed : TASK_STARTUP16-1;
+}
+
+#if TASK_STATIC_CALLS
+/* Generated by the Makefile from every TASK_DECLARE() and TASK_DECLARE16() in
+ * the build, in the order the linker would build the task list, see task.h
+ */
+# include "task_table.h"
+
+# define TASK_STATIC8(priority_, task_cycle_) task_static8_##priority_##_##task_cycle_
+# define TASK_STATIC16(priority_, task_cycle_) task_static16_##priority_##_##task_cycle_
+
+# define TASK_STATIC_EXTERN8(priority_, task_cycle_) \
+extern uint8_t TASK_STATIC8(priority_, task_cycle_)(uint8_t);
+# define TASK_STATIC_EXTERN16(priority_, task_cycle_) \
+extern uint16_t TASK_STATIC16(priority_, task_cycle_)(uint16_t);
+# define TASK_STATIC_EXTERN(width_, priority_, task_cycle_) \
+TASK_STATIC_EXTERN##width_(priority_, task_cycle_)
+TASK_TABLE(TASK_STATIC_EXTERN)
+# undef TASK_STATIC_EXTERN
+# undef TASK_STATIC_EXTERN8
+# undef TASK_STATIC_EXTERN16
+
+# define TASK_STATIC_COUNT(width_, priority_, task_cycle_) +1
+# define TASK_COUNT (0 TASK_TABLE(TASK_STATIC_COUNT))
+# if TASK_COUNT == 0
+#  error "No tasks: TASK_DECLARE() at least one"
+# endif
+# define TASK_STATIC_COUNT16(width_, priority_, task_cycle_) +(width_ == 16)
+# define TASK_COUNT16 (0 TASK_TABLE(TASK_STATIC_COUNT16))
+#else
+/* See TASK_DECLARE() and TASK_DECLARE16() which build an array of task
+ * entries in priority order
+ */
+extern const struct task_entry task_list_start asm("__task_list_start");
+extern const struct task_entry task_list_end asm("__task_list_end");
+
+/* Never 0, etc/linker.ld fails the link without any tasks */
+# define TASK_COUNT (&task_list_end - &task_list_start)
+
+# if TASK_PROFILING
+/**
+ * @brief Count the TASK_DECLARE16() tasks in the task list
+ * @return count
+ */
+static uint8_t task_count16(void)
+{
+    uint8_t count = 0;
+    for (const struct task_entry* entry = &task_list_start; entry != &task_list_end; entry++)
+        count += !!pgm_read_byte_near(&entry->wide);
+    return count;
 }
+#  define TASK_COUNT16 task_count16()
+# endif
+#endif
 
+#if TASK_PROFILING
 /**
- * @brief Call task_cycle for each task, collating next wake times
- * @param [in] ms_later how many milliseconds elapsed since last call
- * @return time to sleep before next call or TASK_SHUTDOWN
+ * @brief CPU time used by a task, in TIMER0 counts of TIMER_PRESCALE cycles
+ * @note a count is TIMER_PRESCALE cycles, 1024 (62us at 16.5MHz) from
+ *       1.024MHz up, and every figure is only to a count. A call shorter
+ *       than that reads as 0 or 1 counts depending on where in a count it
+ *       started, and tasks start in step with TIMER0, so short calls don't
+ *       average out over many either.
  */
-static uint8_t task_cycle_all(uint8_t ms_later)
+struct task_profile
 {
-    uint8_t all_wake = UINT8_MAX;
+    uint32_t calls;     /**< number of calls */
+    uint32_t total;     /**< counts in all calls */
+    uint16_t min;       /**< fewest counts in a call */
+    uint16_t max;       /**< most counts in a call */
+};
 
-    /* See TASK_DECLARE() which builds an array of task function pointers */
-    extern const task_cycle task_list_start asm("__task_list_start");
-    extern const task_cycle task_list_end asm("__task_list_end");
-    for (const task_cycle* pTask = &task_list_start; pTask != &task_list_end; pTask++)
+/**
+ * @brief Start of the profile saved to EEPROM at shutdown, which is followed
+ *        by as many struct task_profile as fit, in task list order (see
+ *        __task_list_start in the .map file)
+ */
+struct task_profile_header
+{
+    uint8_t tasks;      /**< number of struct task_profile saved */
+    uint8_t tasks16;    /**< how many of those are TASK_DECLARE16() tasks */
+    uint16_t prescale;  /**< F_CPU cycles per count */
+};
+
+/**
+ * @brief Read TIMER0 counts since task_main() started
+ * @return counts
+ * @note called with interrupts enabled
+ */
+static uint32_t task_profile_now(void)
+{
+    /* The counter runs on past a comparison not yet accounted */
+    cli();
+    uint32_t now = task_profile_counts + (uint8_t)(TCNT0 - task_chunk_start);
+    sei();
+    return now;
+}
+
+/**
+ * @brief Account for one call of a task
+ * @param [in,out] profile of the task
+ * @param [in] counts taken by the call
+ */
+static void task_profile_update(struct task_profile* profile, uint32_t counts)
+{
+    uint16_t counts16 = (counts < UINT16_MAX) ? (uint16_t)counts : UINT16_MAX;
+    if (!profile->calls || counts16 < profile->min)
+        profile->min = counts16;
+    if (counts16 > profile->max)
+        profile->max = counts16;
+    profile->total += counts;
+    profile->calls++;
+}
+#endif
+
+/**
+ * @brief Scheduler record of each task, in the same order as the task list
+ */
+struct task_state
+{
+    uint16_t later; /**< milliseconds elapsed since task was last called */
+    uint16_t wake;  /**< milliseconds task asked to sleep after last call, or TASK_DORMANT16 */
+    volatile bool notified; /**< task_notify() called since last call */
+    bool awake;     /**< task_stay_awake() called in last call */
+#if TASK_PROFILING
+    struct task_profile profile;    /**< CPU time used */
+#endif
+};
+
+/**
+ * @brief Scheduler records while task_main() is running, for task_notify()
+ */
+static struct task_state* volatile task_states;
+
+/**
+ * @brief Scheduler record of the task being called, for task_stay_awake()
+ */
+static struct task_state* task_current;
+
+/**
+ * @brief Call a task if it is due, collating next wake times
+ * @param [in,out] state of the task
+ * @param [in] ms_later as task_cycle_all()
+ * @param [in] all_wake soonest wake time of tasks so far
+ * @param [in] entry in the task list, or NULL to call one of
+ * @param [in] task8 8-bit task, or NULL
+ * @param [in] task16 16-bit task, or NULL
+ * @return soonest wake time including this task
+ * @note always inlined so constant task pointers become direct calls
+ */
+static inline __attribute__((always_inline))
+uint16_t task_cycle_one(struct task_state* state, uint16_t ms_later, uint16_t all_wake,
+                        const struct task_entry* entry, task_cycle task8, task_cycle16 task16)
+{
+    uint16_t task_later = ms_later;
+    if (ms_later != TASK_STARTUP16 && ms_later != TASK_SHUTDOWN)
+    {
+        /* Only call the task once its own sleep has expired */
+        task_later = state->later + ms_later;
+        if (task_later < ms_later || task_later == TASK_STARTUP16)
+            task_later = TASK_STARTUP16-1;
+        state->later = task_later;
+        if (task_later < state->wake && !state->notified)
+        {
+            /* Dormant tasks never hold the others' sleep short */
+            if (state->wake == TASK_DORMANT16)
+                return all_wake;
+
+            uint16_t remaining = state->wake - task_later;
+            return (remaining < all_wake) ? remaining : all_wake;
+        }
+    }
+
+#if !TASK_STATIC_CALLS
+    if (entry)
     {
         /* Array is stored in flash so we need to explicitly read */
-        task_cycle task = (task_cycle)pgm_read_word_near(pTask);
+        task8 = (task_cycle)pgm_read_word_near(&entry->cycle);
+        if (pgm_read_byte_near(&entry->wide))
+            task16 = (task_cycle16)task8;
+    }
+#endif
+    state->notified = false;
 
-        /* Give the task a chance to run and tell us how long it can sleep for */
-        uint8_t wake = task(ms_later);
+    /* Whether it still needs the CPU awake is up to this call */
+    task_awake -= state->awake;
+    state->awake = false;
+    task_current = state;
 
-        /* Collate the soonest waking task */
-        if (wake < all_wake)
-            all_wake = wake;
+#if TASK_PROFILING
+    /* Interrupts are off for shutdown, and after it's too late to save */
+    uint32_t start = 0;
+    if (ms_later != TASK_SHUTDOWN)
+        start = task_profile_now();
+#endif
+
+    /* Give the task a chance to run and tell us how long it can sleep for */
+    uint16_t wake;
+    if (task16)
+    {
+        /* TASK_DORMANT16 is never reached by task_later, so only
+         * task_notify16() calls it again
+         */
+        wake = task16(task_later);
+    }
+    else
+    {
+        uint8_t later8 = (task_later == TASK_STARTUP16) ? TASK_STARTUP
+                       : (task_later < TASK_STARTUP) ? (uint8_t)task_later
+                       : TASK_STARTUP-1;
+        wake = task8(later8);
+        if (wake == TASK_STARTUP)
+            wake--;
     }
 
+#if TASK_PROFILING
+    if (ms_later != TASK_SHUTDOWN)
+        task_profile_update(&state->profile, task_profile_now() - start);
+#endif
+    task_current = NULL;
+    state->later = 0;
+    state->wake = wake;
+
+    /* Collate the soonest waking task */
+    return (wake < all_wake) ? wake : all_wake;
+}
+
+/**
+ * @brief Call task_cycle for each task that is due, collating next wake times
+ * @param [in,out] state of each task
+ * @param [in] ms_later how many milliseconds elapsed since last call or
+ *             @ref TASK_STARTUP16 / @ref TASK_SHUTDOWN to call every task
+ * @return time to sleep before next call or TASK_SHUTDOWN
+ */
+static uint16_t task_cycle_all(struct task_state* state, uint16_t ms_later)
+{
+    uint16_t all_wake = UINT16_MAX;
+
+#if TASK_STATIC_CALLS
+    /* Direct calls, which the compiler can inline with -flto */
+# define TASK_STATIC_CYCLE8(priority_, task_cycle_) \
+    all_wake = task_cycle_one(state++, ms_later, all_wake, NULL, TASK_STATIC8(priority_, task_cycle_), NULL);
+# define TASK_STATIC_CYCLE16(priority_, task_cycle_) \
+    all_wake = task_cycle_one(state++, ms_later, all_wake, NULL, NULL, TASK_STATIC16(priority_, task_cycle_));
+# define TASK_STATIC_CYCLE(width_, priority_, task_cycle_) \
+    TASK_STATIC_CYCLE##width_(priority_, task_cycle_)
+    TASK_TABLE(TASK_STATIC_CYCLE)
+# undef TASK_STATIC_CYCLE
+# undef TASK_STATIC_CYCLE8
+# undef TASK_STATIC_CYCLE16
+#else
+    for (const struct task_entry* entry = &task_list_start; entry != &task_list_end; entry++, state++)
+        all_wake = task_cycle_one(state, ms_later, all_wake, entry, NULL, NULL);
+#endif
+
     return all_wake;
 }
 
+void task_notify(task_cycle task)
+{
+    struct task_state* state = task_states;
+    if (!state)
+        return;
+
+#if TASK_STATIC_CALLS
+# define TASK_STATIC_NOTIFY8(priority_, task_cycle_) \
+    if (task == TASK_STATIC8(priority_, task_cycle_)) \
+        state->notified = task_notified = true;         \
+    state++;
+# define TASK_STATIC_NOTIFY16(priority_, task_cycle_) \
+    if (task == (task_cycle)TASK_STATIC16(priority_, task_cycle_)) \
+        state->notified = task_notified = true;         \
+    state++;
+# define TASK_STATIC_NOTIFY(width_, priority_, task_cycle_) \
+    TASK_STATIC_NOTIFY##width_(priority_, task_cycle_)
+    TASK_TABLE(TASK_STATIC_NOTIFY)
+# undef TASK_STATIC_NOTIFY
+# undef TASK_STATIC_NOTIFY8
+# undef TASK_STATIC_NOTIFY16
+#else
+    for (const struct task_entry* entry = &task_list_start; entry != &task_list_end; entry++, state++)
+    {
+        if ((task_cycle)pgm_read_word_near(&entry->cycle) == task)
+        {
+            state->notified = true;
+            task_notified = true;
+        }
+    }
+#endif
+}
+
+void task_notify16(task_cycle16 task)
+{
+    task_notify((task_cycle)task);
+}
+
+void task_stay_awake(void)
+{
+    struct task_state* state = task_current;
+    if (state && !state->awake)
+    {
+        state->awake = true;
+        task_awake++;
+    }
+}
+
+#if TASK_PROFILING
+/**
+ * @brief Save the profile of each task to EEPROM, see struct task_profile_header
+ * @param [in] state of each task
+ * @param [in] tasks number of tasks
+ */
+static void task_profile_save(const struct task_state* state, uint8_t tasks)
+{
+    struct task_profile_header header =
+    {
+        .tasks = tasks,
+        .tasks16 = TASK_COUNT16,
+        .prescale = TIMER_PRESCALE,
+    };
+
+    /* Save as many as fit */
+    uint8_t fit = (E2END+1-sizeof(header))/sizeof(struct task_profile);
+    if (header.tasks > fit)
+        header.tasks = fit;
+    if (header.tasks16 > header.tasks)
+        header.tasks16 = header.tasks;
+
+    uint8_t* eeprom = (uint8_t*)0;
+    eeprom_update_block(&header, eeprom, sizeof(header));
+    eeprom += sizeof(header);
+    for (uint8_t i = 0; i < header.tasks; i++, eeprom += sizeof(struct task_profile))
+        eeprom_update_block(&state[i].profile, eeprom, sizeof(struct task_profile));
+}
+#endif
+
 /**
- * @brief Round-robin scheduler calls each task function in turn
+ * @brief Round-robin scheduler calls each task function in turn as it
+ *        becomes due
  */
 void task_main(void)
 {
@@ -106,17 +667,19 @@ void task_main(void)
     cli();
     sleep_enable();
 
-    /* We use TIMER0 with Counter A and /256 prescaler */
-#if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
-    TCCR0A = 0x04;  /* /256 */
-#else
-    TCCR0A = 0x02;  /* OCRA */
-    TCCR0B = 0x04;  /* /256 */
+    /* We use TIMER0 with Counter A and TIMER_PRESCALE, running freely so
+     * no time is lost to a late interrupt. The comparison is moved on from
+     * each interrupt.
+     */
+#if !(TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88)
+    TCCR0A = 0x00;  /* Normal */
 #endif
-
-    /* Reset counter and set ~1ms compare */
+    TIMER_CLOCK(TIMER_CLOCK_SELECT);
     TCNT0 = 0;
-    OCR0A = (uint8_t)(TIMER_SYSCLK_256_2ms/2)-1;
+    OCR0A = 0;
+    task_ticks = task_wake = task_last_wake = 0;
+    task_residue = 0;
+    task_timer_program();
 
     /* Raise interrupt on Compare Match A */
 #if TARGET_MCU_IS_attiny48 || TARGET_MCU_IS_attiny88
@@ -125,18 +688,48 @@ void task_main(void)
     TIMSK = 1<<OCIE0A;
 #endif
 
+    /* Watchdog only wakes us from power down, it never resets */
+    MCUSR &= ~(1<<WDRF);
+    WDT_CONTROL = (1<<WDCE) | (1<<WDE);
+    WDT_CONTROL = 0;
+
+    /* Scheduler record of each task, sized by the linker's task list */
+    struct task_state state[TASK_COUNT];
+    for (uint8_t i = 0; i < sizeof(state)/sizeof(state[0]); i++)
+    {
+        state[i].notified = false;
+        state[i].awake = false;
+#if TASK_PROFILING
+        state[i].profile = (struct task_profile){ 0 };
+#endif
+    }
+#if TASK_PROFILING
+    task_profile_counts = 0;
+#endif
+    task_notified = false;
+    task_awake = 0;
+    task_states = state;
+
     /* Initialise and run */
     sei();
-    for(uint8_t sleep = TASK_STARTUP; sleep != TASK_SHUTDOWN; task_delay(sleep))
+    uint16_t ms_later = TASK_STARTUP16;
+    for (;;)
     {
-        sleep = task_cycle_all(sleep);
-        if (sleep == TASK_STARTUP)
-            sleep--;
+        uint16_t sleep = task_cycle_all(state, ms_later);
+        if (sleep == TASK_SHUTDOWN)
+            break;
+        if (sleep > TASK_DELAY_MAX_ms)
+            sleep = TASK_DELAY_MAX_ms;
+        ms_later = task_delay(sleep);
     }
     cli();
+    task_states = NULL;
 
     /* Shutdown */
-    (void)task_cycle_all(TASK_SHUTDOWN);
+    (void)task_cycle_all(state, TASK_SHUTDOWN);
+#if TASK_PROFILING
+    task_profile_save(state, sizeof(state)/sizeof(state[0]));
+#endif
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
     cli();
     sleep_cpu();
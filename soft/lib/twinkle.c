@@ -40,6 +40,7 @@ static uint8_t twinkle_brightness;  /**< current brightness of light source: 0 =
  */
 static void twinkle_set_pwms(void)
 {
+    pwm_begin();
 #define TWINKLE_SET_PWM(channel_,position_)                                             \
     {                                                                                   \
         uint8_t distance = twinkle_position - position_;                                \
@@ -57,6 +58,7 @@ static void twinkle_set_pwms(void)
     }
 TWINKLE_PWMS(TWINKLE_SET_PWM)
 #undef TWINKLE_SET_PWM
+    pwm_commit();
 }
 
 void twinkle_set_position(uint8_t position)
@@ -23,30 +23,22 @@
 
 static uint8_t blinky_task(uint8_t ms_later)
 {
-    static uint8_t wait;
+    if (ms_later == TASK_SHUTDOWN)
+        twinkle_set_brightness(0);
+
+    TASK_BEGIN(ms_later);
 
-    switch(ms_later)
+    /* Split position range into thirds: ON, OFF, FADE up/down */
+    twinkle_set_position(0);
+    twinkle_set_brightness(85);
+    for (;;)
     {
-    case TASK_STARTUP:
-        wait = 0;
-        /* Split position range into thirds: ON, OFF, FADE up/down */
-        twinkle_set_position(0);
-        twinkle_set_brightness(85);
-        break;
-    case TASK_SHUTDOWN:
-        twinkle_set_brightness(0);
-        break;
-    default:
-        wait += ms_later;
-        if (wait < BLINKY_TICK)
-            break;
-        wait -= BLINKY_TICK;
+        TASK_SLEEP(BLINKY_TICK);
         /* 256x10ms ~ 2.6s cycle */
         twinkle_set_position(twinkle_get_position()+1);
-        break;
     }
 
-    return BLINKY_TICK-wait;
+    TASK_END;
 }
 
 TASK_DECLARE(blinky_task);
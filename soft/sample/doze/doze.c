@@ -18,7 +18,7 @@
 
 /**
  * @brief This task just sleeps, but it is useful
- *        - when CPU_PROFILE_GPIO set in task.c
+ *        - when built with CPU_PROFILE=1
  *        - for measuring sleep current consumption
  * @param ignored
  * @return 250ms sleep
@@ -43,52 +43,32 @@ FADE_PWMS(DRIP_LED)
 
 static uint8_t drip_task(uint8_t ms_later)
 {
-    static uint8_t wait;
     static uint8_t state;
 
-    switch(ms_later)
-    {
-    case TASK_STARTUP:
-        wait = 0;
-        state = 0xFF;
-        /* Fade to black */
-        fade_set_brightness(0);
-        fade_set_update(DRIP_DISPERSE);
-        fade_set_rate_linear(16);
-        break;
-    case TASK_SHUTDOWN:
-        break;
-    default:
-        wait += ms_later;
-        if (wait < DRIP_TICK)
-        {
-            break;
-        }
-        wait = 0;
+    TASK_BEGIN(ms_later);
 
+    /* Fade to black */
+    fade_set_brightness(0);
+    fade_set_update(DRIP_DISPERSE);
+    fade_set_rate_exponential(2);
+    for (;;)
+    {
         /* Start a new drip? */
-        if (state == 0xFF)
+        do
         {
-            if (random_get(DRIP_PROBABILITY) == 0)
-            {
-                state = 0;
-            }
-            break;
-        }
+            TASK_SLEEP(DRIP_TICK);
+        } while (random_get(DRIP_PROBABILITY) != 0);
 
-        /* Avoid using precious RAM for this constant table */
-        uint8_t led = pgm_read_byte_near(&drip_led[state]);
-        pwm_set(led, 255);
-        state++;
-        if (state >= sizeof(drip_led))
+        for (state = 0; state < sizeof(drip_led); state++)
         {
-            /* Drip complete */
-            state = 0xFF;
+            TASK_SLEEP(DRIP_TICK);
+            /* Avoid using precious RAM for this constant table */
+            uint8_t led = pgm_read_byte_near(&drip_led[state]);
+            pwm_set(led, 255);
         }
-        break;
     }
 
-    return DRIP_TICK-wait;
+    TASK_END;
 }
 
 TASK_DECLARE(drip_task);
@@ -22,55 +22,38 @@
 #define KITT_TICK 8
 #define KITT_ENDSTOP 30
 
-#if KITT_ENDSTOP & 1
-# error "KITT_ENDSTOP needs to be an even number"
-#endif
-
 static uint8_t kitt_task(uint8_t ms_later)
 {
-    static uint8_t wait;
+    if (ms_later == TASK_SHUTDOWN)
+        twinkle_set_brightness(0);
+
+    TASK_BEGIN(ms_later);
 
-    switch(ms_later)
+    twinkle_set_position(0);
+    twinkle_set_brightness(40);
+    for (;;)
     {
-    case TASK_STARTUP:
-        wait = 0;
-        twinkle_set_position(0);
-        twinkle_set_brightness(40);
-        break;
-    case TASK_SHUTDOWN:
-        twinkle_set_brightness(0);
-        break;
-    default:
-        wait += ms_later;
-        if (wait < KITT_TICK)
-            break;
-        wait -= KITT_TICK;
         /* 256x8ms ~ 1s cycle */
-        uint8_t was = twinkle_get_position();
-        if (was < KITT_ENDSTOP)
+        TASK_SLEEP(KITT_TICK);
+        /* Left endstop reached: scan right */
+        twinkle_set_position(KITT_ENDSTOP);
+        while (twinkle_get_position() <= 255-KITT_ENDSTOP)
         {
-            /* Left endstop reached: scan right */
-            twinkle_set_position(KITT_ENDSTOP);
+            TASK_SLEEP(KITT_TICK);
+            twinkle_set_position(twinkle_get_position()+2);
         }
-        else if (was > 255-KITT_ENDSTOP)
-        {
-            /* Right endstop reached; scan left */
-            twinkle_set_position(255-KITT_ENDSTOP);
-        }
-        else if ((was & 1) == 0)
-        {
-            /* Scan right on even positions */
-            twinkle_set_position(was+2);
-        }
-        else
+
+        TASK_SLEEP(KITT_TICK);
+        /* Right endstop reached; scan left */
+        twinkle_set_position(255-KITT_ENDSTOP);
+        while (twinkle_get_position() >= KITT_ENDSTOP)
         {
-            /* Scan left on odd positions */
-            twinkle_set_position(was-2);
+            TASK_SLEEP(KITT_TICK);
+            twinkle_set_position(twinkle_get_position()-2);
         }
-        break;
     }
 
-    return KITT_TICK-wait;
+    TASK_END;
 }
 
 TASK_DECLARE(kitt_task);
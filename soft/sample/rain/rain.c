@@ -27,31 +27,20 @@
 
 static uint8_t rain_task(uint8_t ms_later)
 {
-    static uint8_t wait;
+    TASK_BEGIN(ms_later);
 
-    switch(ms_later)
+    /* Fade to black */
+    fade_set_brightness(0);
+    fade_set_update(RAIN_DISPERSE);
+    fade_set_rate_exponential(3);
+    for (;;)
     {
-    case TASK_STARTUP:
-        wait = 0;
-        /* Fade to black */
-        fade_set_brightness(0);
-        fade_set_update(RAIN_DISPERSE);
-        fade_set_rate_linear(8);
-        break;
-    case TASK_SHUTDOWN:
-        break;
-    default:
-        wait += ms_later;
-        if (wait >= RAIN_TICK)
-        {
-            /* pwm_set() ignores addressing a non-existent channel */
-            pwm_set(random_get(RAIN_SPREAD), 255);
-            wait = 0;
-        }        
-        break;
+        TASK_SLEEP(RAIN_TICK);
+        /* pwm_set() ignores addressing a non-existent channel */
+        pwm_set(random_get(RAIN_SPREAD), 255);
     }
 
-    return RAIN_TICK-wait;
+    TASK_END;
 }
 
 TASK_DECLARE(rain_task);
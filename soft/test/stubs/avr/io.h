@@ -18,6 +18,47 @@ extern unsigned char PORTA;
 extern unsigned char PORTB;
 extern unsigned char PORTC;
 
+/* avr-libc ports are macros, so code can check which exist */
+#define PORTA PORTA
+#define PORTB PORTB
+#define PORTC PORTC
+
 extern unsigned char DDRA;
 extern unsigned char DDRB;
 extern unsigned char DDRC;
+
+extern unsigned char TCCR1;
+extern unsigned char GTCCR;
+extern unsigned char OCR1A;
+extern unsigned char OCR1B;
+extern unsigned char OCR1C;
+
+#define PWM1A 6
+#define COM1A1 5
+#define PWM1B 6
+#define COM1B1 5
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+extern unsigned char TIMSK;
+
+#define CTC1 7
+#define OCIE1A 6
+
+/* Tests see every write of USICR, which is a value of mock_usicr[] that
+ * mock_usi_access() acts on at the next access of either USI register
+ * before clearing its strobes
+ */
+extern unsigned char mock_usicr[1];
+extern unsigned char mock_usidr[1];
+unsigned mock_usi_access(void);
+#define USICR mock_usicr[mock_usi_access()]
+#define USIDR mock_usidr[mock_usi_access()]
+
+#define USIWM1 5
+#define USIWM0 4
+#define USICS1 3
+#define USICS0 2
+#define USICLK 1
+#define USITC 0
@@ -16,3 +16,7 @@
 
 void* mock_pgm_read_word_near(const void*);
 #define pgm_read_word_near mock_pgm_read_word_near
+
+#define PROGMEM
+#define pgm_read_byte(address_) (*(const unsigned char*)(address_))
+#define pgm_read_byte_near(address_) (*(const unsigned char*)(address_))
@@ -35,7 +35,9 @@ extern unsigned char TCCR0B;
 extern unsigned char TCNT0;
 extern unsigned char OCR0A;
 extern unsigned char TIMSK;
+extern unsigned char TIFR;
 
 #define OCIE0A 4
+#define OCF0A 4
 
 extern unsigned F_CPU;
@@ -23,10 +23,20 @@
 #define TASK_DECLARE(task_cycle_) \
 const task_cycle task_cycle_##_fn = task_cycle_
 
+#undef TASK_DECLARE16
+#define TASK_DECLARE16(task_cycle_) \
+const task_cycle16 task_cycle_##_fn = task_cycle_
+
+#undef TASK_DECLARE_PRIORITY
+#define TASK_DECLARE_PRIORITY(task_cycle_, priority_) TASK_DECLARE(task_cycle_)
+#undef TASK_DECLARE16_PRIORITY
+#define TASK_DECLARE16_PRIORITY(task_cycle_, priority_) TASK_DECLARE16(task_cycle_)
+
 /**
  * @brief Access the task function declared above
  */
 #define TASK_IMPORT(task_cycle_) extern const task_cycle task_cycle_##_fn
+#define TASK_IMPORT16(task_cycle_) extern const task_cycle16 task_cycle_##_fn
 
 /**
  * @brief Execute the task function defined above
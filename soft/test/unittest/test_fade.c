@@ -19,17 +19,25 @@
 #include "fade.h"       /* Module under test */
 
 /** private fade.c interface */
-extern uint8_t fade_adjust_linear(uint8_t previous);
+extern uint16_t fade_adjust_linear(uint16_t previous, uint8_t brightness, uint16_t rate);
+extern uint16_t fade_adjust_exponential(uint16_t previous, uint8_t brightness, uint8_t shift);
+extern const uint8_t fade_easing[9];
 
 /** task.c mock */
 #define TASK_STUB "../stubs/task.h"
 #include TASK_STUB
-TASK_IMPORT(fade_task);
+TASK_IMPORT16(fade_task);
 
 /** pwm.c mock */
 #define PWM_STUB "pwm.h"
 #include PWM_STUB
 
+#include <math.h>
+#include <stdbool.h>
+
+static bool pwm_batched;  /**< between pwm_begin() and pwm_commit() */
+static unsigned notifies; /**< times fade_task() was woken */
+
 static uint8_t pwm0, pwm1;
 
 /**
@@ -52,6 +60,9 @@ extern uint8_t pwm_get(uint8_t channel)
 
 extern void pwm_set(uint8_t channel, uint8_t duty)
 {
+    /* Channels are always set together */
+    TEST_ASSERT_TRUE_MESSAGE(pwm_batched, "pwm_set() outside pwm_begin()");
+
     switch(channel)
     {
     case 0:
@@ -63,6 +74,39 @@ extern void pwm_set(uint8_t channel, uint8_t duty)
     default:
         TEST_FAIL_MESSAGE("unexpected PWM channel");
     }
+    pwm_set_hook(channel);
+}
+
+extern void pwm_begin(void)
+{
+    TEST_ASSERT_FALSE_MESSAGE(pwm_batched, "pwm_begin() twice");
+    pwm_batched = true;
+}
+
+extern void pwm_commit(void)
+{
+    TEST_ASSERT_TRUE_MESSAGE(pwm_batched, "pwm_commit() without pwm_begin()");
+    pwm_batched = false;
+}
+
+extern void task_notify16(task_cycle16 task)
+{
+    TEST_ASSERT_TRUE(task == TASK_CYCLE(fade_task));
+    notifies++;
+}
+
+/**
+ * @brief Adjust by whole PWM lsbs
+ * @param previous brightness
+ * @param brightness to fade to
+ * @param rate maximum PWM lsbs to move
+ * @return next brightness
+ */
+static uint8_t linear(uint8_t previous, uint8_t brightness, uint8_t rate)
+{
+    uint16_t next = fade_adjust_linear((uint16_t)previous << 8, brightness, (uint16_t)rate << 8);
+    TEST_ASSERT_EQUAL(0, next & 0xFF);
+    return next >> 8;
 }
 
 void setUp(void)
@@ -74,66 +118,55 @@ void setUp(void)
 
 void test_fade_up(void)
 {
-    fade_set_rate_linear(10);
-
     /* Fade up from 0 to 255, skipping uninteresting iterations */
-    fade_set_brightness(255);
-    TEST_ASSERT_EQUAL(10, fade_adjust_linear(0));
-    TEST_ASSERT_EQUAL(20, fade_adjust_linear(10));
-    TEST_ASSERT_EQUAL(130, fade_adjust_linear(120));
-    TEST_ASSERT_EQUAL(250, fade_adjust_linear(240));
-    TEST_ASSERT_EQUAL(255, fade_adjust_linear(250));
+    TEST_ASSERT_EQUAL(10, linear(0, 255, 10));
+    TEST_ASSERT_EQUAL(20, linear(10, 255, 10));
+    TEST_ASSERT_EQUAL(130, linear(120, 255, 10));
+    TEST_ASSERT_EQUAL(250, linear(240, 255, 10));
+    TEST_ASSERT_EQUAL(255, linear(250, 255, 10));
 
     /* Perfect hit target */
-    TEST_ASSERT_EQUAL(255, fade_adjust_linear(245));
+    TEST_ASSERT_EQUAL(255, linear(245, 255, 10));
 
     /* Track target */
-    TEST_ASSERT_EQUAL(255, fade_adjust_linear(255));
+    TEST_ASSERT_EQUAL(255, linear(255, 255, 10));
 
     /* Don't overshoot target */
-    fade_set_brightness(253);
-    TEST_ASSERT_EQUAL(253, fade_adjust_linear(250));
+    TEST_ASSERT_EQUAL(253, linear(250, 253, 10));
 }
 
 void test_fade_down(void)
 {
-    fade_set_rate_linear(10);
-
     /* Fade down from 255 to 0, skipping uninteresting iterations */
-    fade_set_brightness(0);
-    TEST_ASSERT_EQUAL(245, fade_adjust_linear(255));
-    TEST_ASSERT_EQUAL(235, fade_adjust_linear(245));
-    TEST_ASSERT_EQUAL(125, fade_adjust_linear(135));
-    TEST_ASSERT_EQUAL(5, fade_adjust_linear(15));
-    TEST_ASSERT_EQUAL(0, fade_adjust_linear(5));
+    TEST_ASSERT_EQUAL(245, linear(255, 0, 10));
+    TEST_ASSERT_EQUAL(235, linear(245, 0, 10));
+    TEST_ASSERT_EQUAL(125, linear(135, 0, 10));
+    TEST_ASSERT_EQUAL(5, linear(15, 0, 10));
+    TEST_ASSERT_EQUAL(0, linear(5, 0, 10));
 
     /* Perfect hit target */
-    TEST_ASSERT_EQUAL(0, fade_adjust_linear(10));
+    TEST_ASSERT_EQUAL(0, linear(10, 0, 10));
 
     /* Track target */
-    TEST_ASSERT_EQUAL(0, fade_adjust_linear(0));
+    TEST_ASSERT_EQUAL(0, linear(0, 0, 10));
 
     /* Don't overshoot target */
-    fade_set_brightness(2);
-    TEST_ASSERT_EQUAL(2, fade_adjust_linear(5));
+    TEST_ASSERT_EQUAL(2, linear(5, 2, 10));
 }
 
 void test_fade_middle(void)
 {
-    fade_set_rate_linear(30);
-
-    fade_set_brightness(100);
-    TEST_ASSERT_EQUAL(90, fade_adjust_linear(60));
-    TEST_ASSERT_EQUAL(100, fade_adjust_linear(90));
-    TEST_ASSERT_EQUAL(100, fade_adjust_linear(110));
-    TEST_ASSERT_EQUAL(110, fade_adjust_linear(140));
+    TEST_ASSERT_EQUAL(90, linear(60, 100, 30));
+    TEST_ASSERT_EQUAL(100, linear(90, 100, 30));
+    TEST_ASSERT_EQUAL(100, linear(110, 100, 30));
+    TEST_ASSERT_EQUAL(110, linear(140, 100, 30));
 
     /* Perfect hit target */
-    TEST_ASSERT_EQUAL(100, fade_adjust_linear(70));
-    TEST_ASSERT_EQUAL(100, fade_adjust_linear(130));
+    TEST_ASSERT_EQUAL(100, linear(70, 100, 30));
+    TEST_ASSERT_EQUAL(100, linear(130, 100, 30));
 
     /* Track target */
-    TEST_ASSERT_EQUAL(100, fade_adjust_linear(100));
+    TEST_ASSERT_EQUAL(100, linear(100, 100, 30));
 }
 
 void test_fade_task_sleep(void)
@@ -169,14 +202,53 @@ void test_fade_task_idle(void)
     TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
     TEST_ASSERT_EQUAL(200, pwm0);
     TEST_ASSERT_EQUAL(200, pwm1);
-    TEST_ASSERT_EQUAL(255, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
 
     /* Bump just one of the PWMs */
-    pwm1 = 205;
+    pwm_begin();
+    pwm_set(1, 205);
+    pwm_commit();
     TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
     TEST_ASSERT_EQUAL(200, pwm0);
     TEST_ASSERT_EQUAL(200, pwm1);
-    TEST_ASSERT_EQUAL(255, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+}
+
+void test_fade_task_dormant(void)
+{
+    pwm0 = pwm1 = 200;
+    fade_set_rate_linear(5);
+    fade_set_brightness(200);
+    fade_set_update(100);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+
+    /* An effect setting a duty wakes it to fade back */
+    notifies = 0;
+    pwm_begin();
+    pwm_set(1, 203);
+    pwm_commit();
+    TEST_ASSERT_EQUAL(1, notifies);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+
+    /* Each setter wakes it, and it updates at once however long it slept */
+    notifies = 0;
+    fade_set_brightness(100);
+    TEST_ASSERT_EQUAL(1, notifies);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(40000));
+    TEST_ASSERT_EQUAL(195, pwm0);
+    fade_set_rate_linear(10);
+    fade_set_update(50);
+    TEST_ASSERT_EQUAL(2, notifies);
+    TEST_ASSERT_EQUAL(50, TASK_CYCLE(fade_task)(50));
+    TEST_ASSERT_EQUAL(185, pwm0);
+
+    /* Its own updates don't wake it */
+    while (TASK_CYCLE(fade_task)(50) != TASK_DORMANT16)
+        ;
+    TEST_ASSERT_EQUAL(100, pwm0);
+    TEST_ASSERT_EQUAL(100, pwm1);
+    TEST_ASSERT_EQUAL(2, notifies);
 }
 
 void test_fade_task_instantaneous(void)
@@ -186,7 +258,209 @@ void test_fade_task_instantaneous(void)
     fade_set_rate_linear(5);
     fade_set_brightness(200);
     fade_set_update(0);
-    TEST_ASSERT_EQUAL(255, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
     TEST_ASSERT_EQUAL(200, pwm0);
     TEST_ASSERT_EQUAL(200, pwm1);
 }
+
+void test_fade_channels(void)
+{
+    pwm0 = 100;
+    pwm1 = 100;
+    fade_set_update(100);
+
+    /* Each channel fades its own way at its own rate */
+    fade_set_channel(0, 150, FADE_LSBS(20));
+    fade_set_channel(1, 40, FADE_LSBS(25));
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(120, pwm0);
+    TEST_ASSERT_EQUAL(75, pwm1);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(140, pwm0);
+    TEST_ASSERT_EQUAL(50, pwm1);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(150, pwm0);
+    TEST_ASSERT_EQUAL(40, pwm1);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+
+    /* Channels not faded are ignored */
+    fade_set_channel(7, 0, FADE_LSBS(255));
+
+    /* Retarget one, the other stays put */
+    fade_set_channel(1, 90, FADE_LSBS(50));
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(150, pwm0);
+    TEST_ASSERT_EQUAL(90, pwm1);
+
+    /* Without an update interval, each goes straight to its own target */
+    fade_set_channel(0, 10, FADE_LSBS(1));
+    fade_set_update(0);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(10, pwm0);
+    TEST_ASSERT_EQUAL(90, pwm1);
+
+    /* The global setters override every channel */
+    fade_set_brightness(200);
+    fade_set_rate_linear(5);
+    fade_set_update(100);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(15, pwm0);
+    TEST_ASSERT_EQUAL(95, pwm1);
+}
+
+void test_fade_fraction(void)
+{
+    /* Quarter of an lsb each update */
+    TEST_ASSERT_EQUAL(0x0040, fade_adjust_linear(0x0000, 255, FADE_LSBS(0.25)));
+    TEST_ASSERT_EQUAL(0x0100, fade_adjust_linear(0x00C0, 255, FADE_LSBS(0.25)));
+    TEST_ASSERT_EQUAL(0x0FC0, fade_adjust_linear(0x1000, 0, FADE_LSBS(0.25)));
+
+    /* Fractions land exactly on target */
+    TEST_ASSERT_EQUAL(0x6400, fade_adjust_linear(0x63F0, 100, FADE_LSBS(0.25)));
+    TEST_ASSERT_EQUAL(0x6400, fade_adjust_linear(0x6410, 100, FADE_LSBS(0.25)));
+    TEST_ASSERT_EQUAL(0xFF00, fade_adjust_linear(0xFE80, 255, FADE_LSBS(2.5)));
+}
+
+/**
+ * @brief Run fade_task() until channel 0 reaches its target
+ * @param rate PWM lsbs it may move per update, 8.8 fixed point
+ * @return updates taken
+ */
+static unsigned fade_updates(uint16_t rate)
+{
+    unsigned updates = 0;
+    uint8_t previous = pwm0;
+
+    while (TASK_CYCLE(fade_task)(100) != TASK_DORMANT16)
+    {
+        /* Never more than the rate in one update, give or take the fraction */
+        unsigned moved = (pwm0 > previous) ? pwm0 - previous : previous - pwm0;
+        TEST_ASSERT_TRUE((moved << 8) < rate + 256u);
+        previous = pwm0;
+        updates++;
+    }
+
+    return updates;
+}
+
+void test_fade_duration(void)
+{
+    static const uint16_t rates[] =
+    {
+        FADE_LSBS(0.1), FADE_LSBS(0.25), FADE_LSBS(1.0/3), FADE_LSBS(1),
+        FADE_LSBS(2.5), FADE_LSBS(16), FADE_LSBS(100)
+    };
+
+    fade_set_update(100);
+    pwm1 = 0;
+    fade_set_channel(1, 0, 0);
+
+    for (uint8_t i = 0; i < sizeof(rates)/sizeof(rates[0]); i++)
+    {
+        /* Full scale takes exactly as many updates as the rate says, however
+         * small it is
+         */
+        unsigned expect = (255u*256 + rates[i] - 1) / rates[i];
+
+        pwm0 = 0;
+        fade_set_channel(0, 255, rates[i]);
+        TEST_ASSERT_EQUAL(expect, fade_updates(rates[i]));
+        TEST_ASSERT_EQUAL(255, pwm0);
+
+        fade_set_channel(0, 0, rates[i]);
+        TEST_ASSERT_EQUAL(expect, fade_updates(rates[i]));
+        TEST_ASSERT_EQUAL(0, pwm0);
+    }
+
+    unsigned slowest = (255u*256 + rates[0] - 1) / rates[0];
+    TEST_PRINTF("fade: full scale in %u updates, %us at 100ms, by %u/256 lsb each",
+                slowest, slowest/10, rates[0]);
+}
+
+void test_fade_exponential(void)
+{
+    /* An eighth of the way each update */
+    TEST_ASSERT_EQUAL(0xDF20, fade_adjust_exponential(0xFF00, 0, 3));
+    TEST_ASSERT_EQUAL(0x1FE0, fade_adjust_exponential(0x0000, 255, 3));
+    TEST_ASSERT_EQUAL(0x65C0, fade_adjust_exponential(0x6600, 100, 3));
+
+    /* At least 1/256 lsb, so it always gets there */
+    TEST_ASSERT_EQUAL(0x6405, fade_adjust_exponential(0x6406, 100, 3));
+    TEST_ASSERT_EQUAL(0x6400, fade_adjust_exponential(0x6401, 100, 3));
+    TEST_ASSERT_EQUAL(0x6400, fade_adjust_exponential(0x6400, 100, 3));
+
+    /* No shift jumps straight to target */
+    TEST_ASSERT_EQUAL(0x6400, fade_adjust_exponential(0xFF00, 100, 0));
+}
+
+void test_fade_exponential_curve(void)
+{
+    pwm0 = 255;
+    pwm1 = 128;
+    fade_set_update(100);
+    fade_set_brightness(0);
+    fade_set_rate_exponential(2);
+
+    /* Both decay a quarter of the way each update */
+    unsigned updates = 0;
+    while (TASK_CYCLE(fade_task)(100) != TASK_DORMANT16)
+    {
+        updates++;
+        TEST_ASSERT_TRUE(updates < 100);
+        double decay = pow(0.75, updates);
+        if (255*decay >= 1)
+            TEST_ASSERT_TRUE(fabs(pwm0 - 255*decay) <= 1);
+        if (128*decay >= 1)
+            TEST_ASSERT_TRUE(fabs(pwm1 - 128*decay) <= 1);
+    }
+    TEST_ASSERT_EQUAL(0, pwm0);
+    TEST_ASSERT_EQUAL(0, pwm1);
+    TEST_PRINTF("fade: exponential 255 to 0 in %u updates, a quarter of the way each", updates);
+
+    /* And rise the same way */
+    fade_set_brightness(200);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(50, pwm0);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(87, pwm0);
+}
+
+void test_fade_eased(void)
+{
+    pwm0 = 20;
+    pwm1 = 220;
+    fade_set_update(100);
+    fade_set_rate_eased(1);
+
+    /* Each follows the curve from where it was, up or down */
+    fade_set_brightness(120);
+    for (uint8_t entry = 1; entry < sizeof(fade_easing); entry++)
+    {
+        TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+        unsigned fraction = fade_easing[entry];
+        TEST_ASSERT_EQUAL(20 + (100*fraction + 100)/256, pwm0);
+        TEST_ASSERT_EQUAL(220 - (100*fraction + 100)/256, pwm1);
+    }
+    TEST_ASSERT_EQUAL(120, pwm0);
+    TEST_ASSERT_EQUAL(120, pwm1);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+
+    /* Retargeting starts a new curve, twice as fast */
+    fade_set_rate_eased(2);
+    fade_set_brightness(0);
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(120 - (120*37 + 120)/256, pwm0);
+    for (uint8_t update = 0; update < 3; update++)
+        TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(0, pwm0);
+    TEST_ASSERT_EQUAL(0, pwm1);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+
+    /* Without an update interval, it goes straight to target */
+    fade_set_brightness(90);
+    fade_set_update(0);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(90, pwm0);
+    fade_set_update(100);
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+}
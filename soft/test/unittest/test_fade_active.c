@@ -0,0 +1,198 @@
+/*! \file test_fade_active.c
+ *
+ *  \brief Fading many channels unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration. Including it by
+ * macro stops fade.c being linked with the usual one.
+ */
+#define FADE_CONFIG "fade_active.config"
+#define FADE_SOURCE "../../lib/fade.c"
+#include FADE_SOURCE
+
+#include <string.h>
+
+#define CHANNELS 16     /**< covers ../stubs/fade_active.config */
+#define FADED 12
+
+/** pwm.c mock */
+static bool pwm_batched;
+static uint8_t pwm[CHANNELS];
+static unsigned visits;     /**< channels fade_task() has looked at */
+
+uint8_t pwm_get(uint8_t channel)
+{
+    TEST_ASSERT_TRUE(channel < CHANNELS);
+    visits++;
+    return pwm[channel];
+}
+
+void pwm_set(uint8_t channel, uint8_t duty)
+{
+    TEST_ASSERT_TRUE(channel < CHANNELS);
+    pwm[channel] = duty;
+    pwm_set_hook(channel);
+}
+
+void pwm_begin(void)
+{
+    TEST_ASSERT_FALSE(pwm_batched);
+    pwm_batched = true;
+}
+
+void pwm_commit(void)
+{
+    TEST_ASSERT_TRUE(pwm_batched);
+    pwm_batched = false;
+}
+
+/** task.c mock */
+static unsigned notifies;   /**< times fade_task() was woken */
+
+void task_notify16(task_cycle16 task)
+{
+    TEST_ASSERT_TRUE(task == fade_task);
+    notifies++;
+}
+
+/**
+ * @brief Run fade updates until every channel is at target
+ * @param most returns the most channels visited in an update
+ * @return updates that changed something
+ */
+static unsigned run_updates(unsigned* most)
+{
+    unsigned updates = 0;
+    *most = 0;
+
+    for (;;)
+    {
+        visits = 0;
+        uint16_t sleep = TASK_CYCLE(fade_task)(100);
+        if (visits > *most)
+            *most = visits;
+        if (sleep == TASK_DORMANT16)
+            return updates;
+        updates++;
+        TEST_ASSERT_TRUE(updates < 1000);
+    }
+}
+
+void setUp(void)
+{
+    unsigned most;
+
+    memset(pwm, 0, sizeof(pwm));
+    TASK_CYCLE(fade_task)(TASK_STARTUP16);
+    fade_set_update(100);
+    fade_set_brightness(0);
+    fade_set_rate_exponential(3);
+
+    /* Everything's looked at once, then nothing */
+    TEST_ASSERT_EQUAL(0, run_updates(&most));
+    TEST_ASSERT_EQUAL(FADED, most);
+    run_updates(&most);
+    TEST_ASSERT_EQUAL(0, most);
+}
+
+void tearDown(void)
+{
+    TASK_CYCLE(fade_task)(TASK_SHUTDOWN);
+}
+
+void test_one_drop(void)
+{
+    unsigned most;
+
+    /* An effect lights one channel, which wakes the fade once, and only
+     * that one fades
+     */
+    notifies = 0;
+    pwm_set(5, 255);
+    TEST_ASSERT_EQUAL(1, notifies);
+    unsigned updates = run_updates(&most);
+    TEST_ASSERT_EQUAL(0, pwm[5]);
+    TEST_ASSERT_EQUAL(1, most);
+
+    /* Fading it never woke the fade again */
+    TEST_ASSERT_EQUAL(1, notifies);
+
+    TEST_PRINTF("fade: %u of %u channels visited in each of %u updates while one fades",
+                most, FADED, updates);
+}
+
+void test_unfaded(void)
+{
+    unsigned most;
+
+    /* Channels not in FADE_PWMS are left alone */
+    pwm_set(11, 255);
+    pwm_set(13, 255);
+    TEST_ASSERT_EQUAL(0, run_updates(&most));
+    TEST_ASSERT_EQUAL(0, most);
+    TEST_ASSERT_EQUAL(255, pwm[11]);
+    TEST_ASSERT_EQUAL(255, pwm[13]);
+}
+
+void test_overlapping_drops(void)
+{
+    unsigned most;
+
+    pwm_set(0, 255);
+    pwm_set(12, 128);
+    visits = 0;
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(2, visits);
+
+    /* Another starts part way through */
+    pwm_set(7, 200);
+    visits = 0;
+    TEST_ASSERT_EQUAL(100, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(3, visits);
+
+    /* Each stops being visited once it's there */
+    run_updates(&most);
+    TEST_ASSERT_EQUAL(3, most);
+    TEST_ASSERT_EQUAL(0, pwm[0]);
+    TEST_ASSERT_EQUAL(0, pwm[7]);
+    TEST_ASSERT_EQUAL(0, pwm[12]);
+}
+
+void test_retarget(void)
+{
+    unsigned most;
+
+    /* Changing one channel's target only wakes that one */
+    fade_set_channel(12, 100, FADE_LSBS(10));
+    TEST_ASSERT_EQUAL(10, run_updates(&most));
+    TEST_ASSERT_EQUAL(1, most);
+    TEST_ASSERT_EQUAL(100, pwm[12]);
+
+    /* Changing every target wakes them all */
+    fade_set_brightness(10);
+    run_updates(&most);
+    TEST_ASSERT_EQUAL(FADED, most);
+    for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        TEST_ASSERT_EQUAL((channel == 11 || channel > 12) ? 0 : 10, pwm[channel]);
+
+    /* Going straight to target only sets those that aren't there */
+    fade_set_update(0);
+    pwm_set(3, 99);
+    pwm[0] = 77;
+    TEST_ASSERT_EQUAL(TASK_DORMANT16, TASK_CYCLE(fade_task)(100));
+    TEST_ASSERT_EQUAL(10, pwm[3]);
+    TEST_ASSERT_EQUAL(77, pwm[0]);
+}
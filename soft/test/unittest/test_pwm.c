@@ -22,22 +22,67 @@
 #include TASK_STUB
 #include "../stubs/avr/io.h"
 
+#include <stdbool.h>
+
 /** task.c mock */
 TASK_IMPORT(pwm_task);
 
 /** avr/io.h mock */
 unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+unsigned char TCCR1, GTCCR, OCR1A, OCR1B, OCR1C;
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+/** task.c mock */
+static bool stay_awake;     /**< task_stay_awake() called */
+
+void task_stay_awake(void)
+{
+    stay_awake = true;
+}
+
+static unsigned notified;   /**< task_notify() calls */
+
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(TASK_CYCLE(pwm_task), task);
+    notified++;
+}
+
+/**
+ * @brief Run pwm_task() once
+ * @return whether it kept the CPU from powering down
+ */
+static bool pwm_task_awake(void)
+{
+    stay_awake = false;
+    TASK_CYCLE(pwm_task)(1);
+    return stay_awake;
+}
+
+/** pwm.c internals */
+extern const uint8_t pwm_software_channels;
+
+/** Most software channels ON together during the last run_2s() */
+static unsigned peak_on;
 
 
 void setUp(void)
 {
     DDRA=DDRB=DDRC=0;
+    TCCR1=GTCCR=OCR1C=0;
 
     TASK_CYCLE(pwm_task)(TASK_STARTUP);
 
     TEST_ASSERT_EQUAL(1<<1, DDRA);
-    TEST_ASSERT_EQUAL(1<<2, DDRB);
+    TEST_ASSERT_EQUAL((1<<2)|(1<<4), DDRB);
     TEST_ASSERT_EQUAL(1<<3, DDRC);
+
+    /* TIMER1 PWM A and B up to 255 at clk/64 */
+    TEST_ASSERT_EQUAL((1<<PWM1A)|(1<<CS12)|(1<<CS11)|(1<<CS10), TCCR1);
+    TEST_ASSERT_TRUE(GTCCR & (1<<PWM1B));
+    TEST_ASSERT_EQUAL(255, OCR1C);
 }
 
 void tearDown(void)
@@ -47,8 +92,12 @@ void tearDown(void)
     TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
 
     TEST_ASSERT_EQUAL(0xFF^(1<<1), DDRA);
-    TEST_ASSERT_EQUAL(0xFF^(1<<2), DDRB);
+    TEST_ASSERT_EQUAL(0xFF^((1<<2)|(1<<4)), DDRB);
     TEST_ASSERT_EQUAL(0xFF^(1<<3), DDRC);
+
+    /* TIMER1 stopped */
+    TEST_ASSERT_EQUAL(0, TCCR1);
+    TEST_ASSERT_EQUAL(0, GTCCR);
 }
 
 /**
@@ -56,22 +105,36 @@ void tearDown(void)
  * @param channel0 returns observed duty on channel 0
  * @param channel1 returns observed duty on channel 0
  * @param channel2 returns observed duty on channel 0
+ * @param min_sleep_ms shortest sleep the duties should need
+ * @return number of times the task was called
  */
-static void run_2s(uint8_t* channel0, uint8_t* channel1, uint8_t* channel2)
+static unsigned run_2s(uint8_t* channel0, uint8_t* channel1, uint8_t* channel2,
+                       unsigned min_sleep_ms)
 {
     unsigned ch0_ms=0, ch1_ms=0, ch2_ms=0;
+    unsigned calls=0;
     PORTA = PORTB = PORTC = 0;
+    peak_on = 0;
 
     for (unsigned time_ms = 0, sleep_ms = 1; time_ms < 2000; time_ms += sleep_ms)
     {
         /* Run PWM task */
+        mock_gpio_port_writes = 0;
         sleep_ms = TASK_CYCLE(pwm_task)(sleep_ms);
         TEST_ASSERT_TRUE(sleep_ms != TASK_SHUTDOWN);
+        calls++;
 
-        /* Tests are OFF, HALF, QUARTER, ON and should never need to run
-         * faster than 250Hz
+        /* Ports A, B and C each switched in a single write */
+        TEST_ASSERT_EQUAL(3, mock_gpio_port_writes);
+
+        /* Most tests are OFF, HALF, QUARTER, ON and should never need to
+         * run faster than 250Hz
          */
-        TEST_ASSERT_TRUE(sleep_ms >= 4);
+        TEST_ASSERT_TRUE(sleep_ms >= min_sleep_ms);
+
+        /* Only observe up to 2s */
+        if (time_ms + sleep_ms > 2000)
+            sleep_ms = 2000 - time_ms;
 
         /* Observe PWM duty - note channels are mapped (0,1,2)->(B,A,C) */
         if (PORTA == 1<<1)
@@ -86,6 +149,10 @@ static void run_2s(uint8_t* channel0, uint8_t* channel1, uint8_t* channel2)
             ch2_ms += sleep_ms;
         else
             TEST_ASSERT_EQUAL(0, PORTC);
+
+        unsigned on = !!PORTA + !!PORTB + !!PORTC;
+        if (on > peak_on)
+            peak_on = on;
     }
 
     /* Calculate and write results */
@@ -95,23 +162,27 @@ static void run_2s(uint8_t* channel0, uint8_t* channel1, uint8_t* channel2)
         *channel1 = (uint8_t)((255*ch1_ms)/2000);
     if (channel2)
         *channel2 = (uint8_t)((255*ch2_ms)/2000);
+
+    return calls;
 }
 
 void test_set_get(void)
 {
-    /* Only 3 PWM channels defined */
+    /* Only 4 PWM channels defined */
     pwm_set(0, 0x11);
     pwm_set(1, 0x72);
     pwm_set(2, 0xF3);
+    pwm_set(3, 0x3C);
     /* Setting others is No-Op */
-    for (unsigned i = 3; i < 256; i++)
+    for (unsigned i = 4; i < 256; i++)
         pwm_set(i, 44);
 
     TEST_ASSERT_EQUAL(0x11, pwm_get(0));
     TEST_ASSERT_EQUAL(0x72, pwm_get(1));
     TEST_ASSERT_EQUAL(0xF3, pwm_get(2));
+    TEST_ASSERT_EQUAL(0x3C, pwm_get(3));
     /* Fetching non-existent channels */
-    for (unsigned i = 3; i < 256; i++)
+    for (unsigned i = 4; i < 256; i++)
         TEST_ASSERT_EQUAL(0, pwm_get(i));
 }
 
@@ -122,7 +193,7 @@ void test_off_duty(void)
     pwm_set(2, 0);
 
     uint8_t ch0, ch1, ch2;
-    run_2s(&ch0, &ch1, &ch2);
+    run_2s(&ch0, &ch1, &ch2, 4);
 
     TEST_ASSERT_EQUAL(0, ch0);
     TEST_ASSERT_EQUAL(0, ch1);
@@ -136,7 +207,7 @@ void test_quarter_duty(void)
     pwm_set(2, 0xC0);
 
     uint8_t ch0, ch1, ch2;
-    run_2s(&ch0, &ch1, &ch2);
+    run_2s(&ch0, &ch1, &ch2, 4);
 
     TEST_ASSERT_EQUAL(0, ch0);
     TEST_ASSERT_UINT8_WITHIN(1, 0x40, ch1);
@@ -150,7 +221,7 @@ void test_half_duty(void)
     pwm_set(2, 0x7F);
 
     uint8_t ch0, ch1, ch2;
-    run_2s(&ch0, &ch1, &ch2);
+    run_2s(&ch0, &ch1, &ch2, 4);
 
     TEST_ASSERT_UINT8_WITHIN(1, 0x80, ch0);
     TEST_ASSERT_EQUAL(0, ch1);
@@ -164,9 +235,141 @@ void test_on_duty(void)
     pwm_set(2, 0xFF);
 
     uint8_t ch0, ch1, ch2;
-    run_2s(&ch0, &ch1, &ch2);
+    run_2s(&ch0, &ch1, &ch2, 4);
 
     TEST_ASSERT_EQUAL(0xFF, ch0);
     TEST_ASSERT_EQUAL(0xFF, ch1);
     TEST_ASSERT_EQUAL(0xFF, ch2);
 }
+
+void test_steady_sleep(void)
+{
+    /* Nothing switching, so sleep long enough to power down */
+    pwm_set(0, 0);
+    pwm_set(1, 0xFF);
+    pwm_set(2, 0);
+    pwm_set(3, 0xFF);
+    TEST_ASSERT_FALSE(pwm_task_awake());
+
+    /* One channel switching, so wake for it at once rather than after the
+     * steady sleep, and just the once
+     */
+    notified = 0;
+    pwm_set(2, 0x40);
+    pwm_set(2, 0x80);
+    TEST_ASSERT_EQUAL(1, notified);
+    for (unsigned time_ms = 0, sleep_ms = 1; time_ms < 100; time_ms += sleep_ms)
+    {
+        stay_awake = false;
+        sleep_ms = TASK_CYCLE(pwm_task)(sleep_ms);
+        TEST_ASSERT_TRUE(sleep_ms <= 16);
+        TEST_ASSERT_TRUE(stay_awake);
+    }
+}
+
+void test_hardware_channel(void)
+{
+    /* Channel 3 is on OC1B so software only switches the other 3 */
+    TEST_ASSERT_EQUAL(3, pwm_software_channels);
+
+    /* New duty is output straight away */
+    pwm_set(3, 0x80);
+    TEST_ASSERT_EQUAL(0x80, OCR1B);
+    TEST_ASSERT_EQUAL((1<<PWM1B)|(1<<COM1B1), GTCCR);
+
+    /* Software leaves PB4 alone, but idles rather than powering down
+     * which would stop TIMER1
+     */
+    pwm_set(0, 0);
+    pwm_set(1, 0xFF);
+    pwm_set(2, 0);
+    PORTB = 0;
+    TEST_ASSERT_TRUE(pwm_task_awake());
+    TEST_ASSERT_EQUAL(0, PORTB);
+
+    /* OFF disconnects OC1B so it doesn't glitch ON each cycle */
+    pwm_set(3, 0);
+    TEST_ASSERT_EQUAL(1<<PWM1B, GTCCR);
+    TEST_ASSERT_FALSE(pwm_task_awake());
+}
+
+void test_commit(void)
+{
+    pwm_set(3, 0x10);
+
+    /* Nothing is output until the outermost commit */
+    pwm_begin();
+    pwm_set(3, 0x90);
+    pwm_begin();
+    pwm_set(0, 0x20);
+    pwm_commit();
+    TEST_ASSERT_EQUAL(0x10, OCR1B);
+
+    /* Duties read back as set */
+    TEST_ASSERT_EQUAL(0x90, pwm_get(3));
+    TEST_ASSERT_EQUAL(0x20, pwm_get(0));
+
+    pwm_commit();
+    TEST_ASSERT_EQUAL(0x90, OCR1B);
+
+    /* A commit without a batch changes nothing */
+    pwm_commit();
+    pwm_set(3, 0x40);
+    TEST_ASSERT_EQUAL(0x40, OCR1B);
+}
+
+void test_every_duty(void)
+{
+    unsigned worst_calls = 0;
+    unsigned worst = 0;
+
+    pwm_set(3, 0);
+    for (unsigned duty = 0; duty < 256; duty++)
+    {
+        const uint8_t expect[3] = { duty, 255-duty, duty^0x55 };
+        for (uint8_t channel = 0; channel < 3; channel++)
+            pwm_set(channel, expect[channel]);
+
+        uint8_t observed[3];
+        unsigned calls = run_2s(&observed[0], &observed[1], &observed[2], 1);
+        if (calls > worst_calls)
+            worst_calls = calls;
+        for (uint8_t channel = 0; channel < 3; channel++)
+        {
+            unsigned error = (observed[channel] > expect[channel])
+                             ? observed[channel] - expect[channel]
+                             : expect[channel] - observed[channel];
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    /* Duties are quantised to 1ms of the 16ms cycle */
+    TEST_ASSERT_TRUE(worst <= 256/16);
+    TEST_PRINTF("software: up to %u wakeups per %uHz frame, worst duty error %u/255",
+                (worst_calls*16+1999)/2000, 1000/16, worst);
+}
+
+void test_staggered(void)
+{
+    unsigned alone = 0;
+
+    /* Every software channel at the same duty would all be ON together */
+    pwm_set(3, 0);
+    for (unsigned duty = 1; duty < 256; duty++)
+    {
+        for (uint8_t channel = 0; channel < 3; channel++)
+            pwm_set(channel, duty);
+        run_2s(NULL, NULL, NULL, 1);
+
+        /* Phases are 4ms apart, so each 4ms a channel stays ON overlaps
+         * one more
+         */
+        unsigned on_ms = (duty+15)/16;
+        TEST_ASSERT_TRUE(peak_on <= (on_ms+3)/4);
+        if (peak_on == 1)
+            alone = duty;
+    }
+
+    TEST_PRINTF("software: one of 3 channels ON at a time up to duty %u/255", alone);
+}
@@ -0,0 +1,240 @@
+/*! \file test_pwm_bam.c
+ *
+ *  \brief Bit-angle modulation Pulse Width Modulation unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration. Including it by
+ * macro stops pwm.c being linked too.
+ */
+#define F_CPU 16500000UL
+#define PWM_CONFIG "pwm_bam.config"
+#define PWM_BAM_SOURCE "../../lib/pwm_bam.c"
+#include PWM_BAM_SOURCE
+
+#include <string.h>
+
+/** TIMER0 interrupt enable, which belongs to the scheduler */
+#define OCIE0A 4
+
+/** avr/io.h mock */
+unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+unsigned char TCCR1, GTCCR, OCR1A, OCR1B, OCR1C, TIMSK;
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+/** task.c mock */
+static bool stay_awake;     /**< task_stay_awake() called */
+
+void task_stay_awake(void)
+{
+    stay_awake = true;
+}
+
+static unsigned notified;   /**< task_notify() calls */
+
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(TASK_CYCLE(pwm_task), task);
+    notified++;
+}
+
+/**
+ * @brief Run pwm_task() once
+ * @return whether it kept the CPU from powering down
+ */
+static bool pwm_task_awake(void)
+{
+    stay_awake = false;
+    TASK_CYCLE(pwm_task)(1);
+    return stay_awake;
+}
+
+
+void setUp(void)
+{
+    DDRA=DDRB=DDRC=0;
+    TIMSK=1<<OCIE0A;
+
+    TASK_CYCLE(pwm_task)(TASK_STARTUP);
+
+    TEST_ASSERT_EQUAL(1<<1, DDRA);
+    TEST_ASSERT_EQUAL((1<<2)|(1<<4), DDRB);
+    TEST_ASSERT_EQUAL(1<<3, DDRC);
+
+    /* TIMER1 CTC interrupt, scheduler's left alone */
+    TEST_ASSERT_EQUAL((1<<OCIE0A)|(1<<OCIE1A), TIMSK);
+    TEST_ASSERT_EQUAL(OCR1C, OCR1A);
+    TEST_ASSERT_TRUE(TCCR1 & (1<<CTC1));
+}
+
+void tearDown(void)
+{
+    DDRA=DDRB=DDRC=0xFF;
+
+    TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
+
+    TEST_ASSERT_EQUAL(0xFF^(1<<1), DDRA);
+    TEST_ASSERT_EQUAL(0xFF^((1<<2)|(1<<4)), DDRB);
+    TEST_ASSERT_EQUAL(0xFF^(1<<3), DDRC);
+
+    /* TIMER1 stopped */
+    TEST_ASSERT_EQUAL(1<<OCIE0A, TIMSK);
+    TEST_ASSERT_EQUAL(0, TCCR1);
+}
+
+/**
+ * @brief Run TIMER1 interrupts for whole frames
+ * @param frames to run
+ * @param high returns CPU cycles each of the 4 channels was ON
+ * @return CPU cycles run
+ */
+static uint32_t run_frames(unsigned frames, uint32_t* high)
+{
+    uint32_t cycles = 0;
+    memset(high, 0, 4*sizeof(high[0]));
+
+    for (unsigned i = 0; i < 8*frames; i++)
+    {
+        mock_gpio_port_writes = 0;
+        MOCK_IRQ(TIMER1_COMPA_vect)();
+
+        /* Ports A, B and C each output in a single write */
+        TEST_ASSERT_EQUAL(3, mock_gpio_port_writes);
+
+        /* CTC up to OCR1C, clock select n divides by 2^(n-1) */
+        uint32_t period = (uint32_t)(OCR1C+1) << ((TCCR1 & 0x0F) - 1);
+        cycles += period;
+
+        if (PORTB & (1<<2))
+            high[0] += period;
+        if (PORTA & (1<<1))
+            high[1] += period;
+        if (PORTC & (1<<3))
+            high[2] += period;
+        if (PORTB & (1<<4))
+            high[3] += period;
+    }
+
+    return cycles;
+}
+
+void test_set_get(void)
+{
+    /* Only 4 PWM channels defined */
+    pwm_set(0, 0x11);
+    pwm_set(1, 0x72);
+    pwm_set(2, 0xF3);
+    pwm_set(3, 0x3C);
+    /* Setting others is No-Op */
+    for (unsigned i = 4; i < 256; i++)
+        pwm_set(i, 44);
+
+    TEST_ASSERT_EQUAL(0x11, pwm_get(0));
+    TEST_ASSERT_EQUAL(0x72, pwm_get(1));
+    TEST_ASSERT_EQUAL(0xF3, pwm_get(2));
+    TEST_ASSERT_EQUAL(0x3C, pwm_get(3));
+    /* Fetching non-existent channels */
+    for (unsigned i = 4; i < 256; i++)
+        TEST_ASSERT_EQUAL(0, pwm_get(i));
+}
+
+void test_every_duty(void)
+{
+    uint32_t high[4];
+    uint32_t frame = 0;
+    unsigned worst = 0;
+
+    /* Other pins on the ports are left alone */
+    PORTA = 1<<0;
+    PORTB = 1<<7;
+    PORTC = 0;
+
+    for (unsigned duty = 0; duty < 256; duty++)
+    {
+        const uint8_t expect[4] = { duty, 255-duty, duty^0x55, duty/2 };
+        for (uint8_t channel = 0; channel < 4; channel++)
+            pwm_set(channel, expect[channel]);
+
+        frame = run_frames(1, high);
+        for (uint8_t channel = 0; channel < 4; channel++)
+        {
+            unsigned observed = (255*high[channel] + frame/2)/frame;
+            unsigned error = (observed > expect[channel]) ? observed - expect[channel]
+                                                          : expect[channel] - observed;
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    TEST_ASSERT_EQUAL(1<<0, PORTA & ~(1<<1));
+    TEST_ASSERT_EQUAL(1<<7, PORTB & ~((1<<2)|(1<<4)));
+    TEST_ASSERT_EQUAL(0, worst);
+    TEST_PRINTF("BAM: 8 interrupts per %luHz frame, worst duty error %u/255",
+                F_CPU/frame, worst);
+}
+
+void test_commit(void)
+{
+    uint32_t high[4];
+
+    const uint8_t before[4] = { 0x0F, 0xF0, 0x33, 0xCC };
+    for (uint8_t channel = 0; channel < 4; channel++)
+        pwm_set(channel, before[channel]);
+    run_frames(1, high);
+    uint8_t active = pwm_bam_active;
+
+    /* Partway through a frame, nothing is built until the commit */
+    for (unsigned i = 0; i < 3; i++)
+        MOCK_IRQ(TIMER1_COMPA_vect)();
+    const uint8_t after[4] = { 0x80, 0x01, 0xFE, 0x7F };
+    pwm_begin();
+    for (uint8_t channel = 0; channel < 4; channel++)
+        pwm_set(channel, after[channel]);
+    TEST_ASSERT_EQUAL(PWM_BAM_NONE, pwm_bam_pending);
+    pwm_commit();
+    TEST_ASSERT_EQUAL(active^1, pwm_bam_pending);
+
+    /* The rest of the frame is the old duties, the next all new */
+    for (unsigned i = 3; i < 8; i++)
+        MOCK_IRQ(TIMER1_COMPA_vect)();
+    TEST_ASSERT_EQUAL(active, pwm_bam_active);
+
+    uint32_t frame = run_frames(1, high);
+    TEST_ASSERT_EQUAL(active^1, pwm_bam_active);
+    for (uint8_t channel = 0; channel < 4; channel++)
+        TEST_ASSERT_EQUAL(after[channel], (255*high[channel] + frame/2)/frame);
+}
+
+void test_steady_sleep(void)
+{
+    /* Nothing dimmed, so outputs are written and TIMER1 may stop */
+    PORTA = PORTB = PORTC = 0;
+    pwm_set(0, 0);
+    pwm_set(1, 0xFF);
+    pwm_set(2, 0xFF);
+    pwm_set(3, 0);
+    TEST_ASSERT_FALSE(pwm_task_awake());
+    TEST_ASSERT_EQUAL(1<<1, PORTA);
+    TEST_ASSERT_EQUAL(0, PORTB);
+    TEST_ASSERT_EQUAL(1<<3, PORTC);
+
+    /* One channel dimmed, so wake to keep TIMER1 running */
+    notified = 0;
+    pwm_set(3, 0x80);
+    TEST_ASSERT_EQUAL(1, notified);
+    TEST_ASSERT_TRUE(pwm_task_awake());
+}
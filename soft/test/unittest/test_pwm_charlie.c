@@ -0,0 +1,268 @@
+/*! \file test_pwm_charlie.c
+ *
+ *  \brief Charlieplexed Pulse Width Modulation unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration. Including it by
+ * macro stops pwm.c being linked too.
+ */
+#define F_CPU 16500000UL
+#define PWM_CONFIG "pwm_charlie.config"
+#define PWM_CHARLIE_SOURCE "../../lib/pwm_charlie.c"
+#include PWM_CHARLIE_SOURCE
+
+#include <string.h>
+
+/** TIMER0 interrupt enable, which belongs to the scheduler */
+#define OCIE0A 4
+
+/** avr/io.h mock */
+unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+unsigned char TCCR1, GTCCR, OCR1A, OCR1B, OCR1C, TIMSK;
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+/** task.c mock */
+static bool stay_awake;     /**< task_stay_awake() called */
+
+void task_stay_awake(void)
+{
+    stay_awake = true;
+}
+
+static unsigned notified;   /**< task_notify() calls */
+
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(TASK_CYCLE(pwm_task), task);
+    notified++;
+}
+
+/**
+ * @brief Run pwm_task() once
+ * @return whether it kept the CPU from powering down
+ */
+static bool pwm_task_awake(void)
+{
+    stay_awake = false;
+    TASK_CYCLE(pwm_task)(1);
+    return stay_awake;
+}
+
+#define PINS 5      /**< matches ../stubs/pwm_charlie.config */
+#define LEDS 20
+
+/** Registers of each charlieplexed pin, in configuration order */
+static unsigned char* const pin_port[PINS] = { &PORTB, &PORTB, &PORTA, &PORTB, &PORTC };
+static unsigned char* const pin_ddr[PINS] = { &DDRB, &DDRB, &DDRA, &DDRB, &DDRC };
+static const uint8_t pin_bit[PINS] = { 1<<0, 1<<1, 1<<2, 1<<3, 1<<4 };
+
+/** Other pins, which must be left alone */
+#define OTHER_A (0xFF^(1<<2))
+#define OTHER_B (0xFF^((1<<0)|(1<<1)|(1<<3)))
+#define OTHER_C (0xFF^(1<<4))
+
+
+void setUp(void)
+{
+    DDRA=DDRB=DDRC=0xFF;
+    PORTA=PORTB=PORTC=0xFF;
+    TIMSK=1<<OCIE0A;
+
+    TASK_CYCLE(pwm_task)(TASK_STARTUP);
+
+    /* Every pin floats, without its pull-up */
+    TEST_ASSERT_EQUAL(OTHER_A, DDRA);
+    TEST_ASSERT_EQUAL(OTHER_B, DDRB);
+    TEST_ASSERT_EQUAL(OTHER_C, DDRC);
+    TEST_ASSERT_EQUAL(OTHER_A, PORTA);
+    TEST_ASSERT_EQUAL(OTHER_B, PORTB);
+    TEST_ASSERT_EQUAL(OTHER_C, PORTC);
+
+    /* TIMER1 CTC interrupt, scheduler's left alone */
+    TEST_ASSERT_EQUAL((1<<OCIE0A)|(1<<OCIE1A), TIMSK);
+    TEST_ASSERT_EQUAL(OCR1C, OCR1A);
+    TEST_ASSERT_TRUE(TCCR1 & (1<<CTC1));
+
+    /* Other pins are only ever set from here */
+    PORTA=PORTB=PORTC=0xAA;
+    DDRA=DDRB=DDRC=0x55;
+    for (uint8_t pin = 0; pin < PINS; pin++)
+    {
+        *pin_port[pin] &= ~pin_bit[pin];
+        *pin_ddr[pin] &= ~pin_bit[pin];
+    }
+}
+
+void tearDown(void)
+{
+    TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
+
+    /* Every pin floats, without its pull-up */
+    for (uint8_t pin = 0; pin < PINS; pin++)
+    {
+        TEST_ASSERT_FALSE(*pin_port[pin] & pin_bit[pin]);
+        TEST_ASSERT_FALSE(*pin_ddr[pin] & pin_bit[pin]);
+    }
+
+    /* TIMER1 stopped */
+    TEST_ASSERT_EQUAL(1<<OCIE0A, TIMSK);
+    TEST_ASSERT_EQUAL(0, TCCR1);
+}
+
+/**
+ * @brief Check the pins are in a legal state and find out which LEDs are lit
+ * @param lit returns whether each LED is lit
+ */
+static void check_pins(bool* lit)
+{
+    int anode = -1;
+
+    memset(lit, 0, LEDS*sizeof(lit[0]));
+    for (uint8_t pin = 0; pin < PINS; pin++)
+    {
+        bool driven = *pin_ddr[pin] & pin_bit[pin];
+        bool high = *pin_port[pin] & pin_bit[pin];
+
+        /* A floating pin never has its pull-up on */
+        TEST_ASSERT_FALSE(!driven && high);
+
+        /* Only one pin is ever driven to Vcc */
+        if (driven && high)
+        {
+            TEST_ASSERT_EQUAL(-1, anode);
+            anode = pin;
+        }
+    }
+
+    /* Everything else stays as it was */
+    TEST_ASSERT_EQUAL(0xAA & OTHER_A, PORTA & OTHER_A);
+    TEST_ASSERT_EQUAL(0xAA & OTHER_B, PORTB & OTHER_B);
+    TEST_ASSERT_EQUAL(0xAA & OTHER_C, PORTC & OTHER_C);
+    TEST_ASSERT_EQUAL(0x55 & OTHER_A, DDRA & OTHER_A);
+    TEST_ASSERT_EQUAL(0x55 & OTHER_B, DDRB & OTHER_B);
+    TEST_ASSERT_EQUAL(0x55 & OTHER_C, DDRC & OTHER_C);
+
+    if (anode < 0)
+        return;
+
+    /* The anode lights an LED to every pin driven to GND */
+    uint8_t led = anode*(PINS-1);
+    for (uint8_t pin = 0; pin < PINS; pin++)
+    {
+        if (pin == anode)
+            continue;
+        lit[led++] = *pin_ddr[pin] & pin_bit[pin];
+    }
+}
+
+/**
+ * @brief Run TIMER1 interrupts for one whole frame
+ * @param high returns units each LED was lit
+ * @return units in the frame
+ */
+static unsigned run_frame(unsigned* high)
+{
+    unsigned units = 0;
+    memset(high, 0, LEDS*sizeof(high[0]));
+
+    for (unsigned i = 0; i < 8*PINS; i++)
+    {
+        MOCK_IRQ(TIMER1_COMPA_vect)();
+
+        /* CTC up to OCR1C, clock select n divides by 2^(n-1) */
+        unsigned period = 1u << ((TCCR1 & 0x0F) - 1);
+        units += period;
+
+        bool lit[LEDS];
+        check_pins(lit);
+        for (uint8_t led = 0; led < LEDS; led++)
+        {
+            if (lit[led])
+                high[led] += period;
+        }
+    }
+
+    return units;
+}
+
+void test_set_get(void)
+{
+    /* Only 20 LEDs defined */
+    for (unsigned i = 0; i < LEDS; i++)
+        pwm_set(i, i*11);
+    /* Setting others is No-Op */
+    for (unsigned i = LEDS; i < 256; i++)
+        pwm_set(i, 44);
+
+    for (unsigned i = 0; i < LEDS; i++)
+        TEST_ASSERT_EQUAL(i*11, pwm_get(i));
+    /* Fetching non-existent channels */
+    for (unsigned i = LEDS; i < 256; i++)
+        TEST_ASSERT_EQUAL(0, pwm_get(i));
+}
+
+void test_every_duty(void)
+{
+    unsigned high[LEDS];
+    unsigned frame = 0;
+
+    for (unsigned duty = 0; duty < 256; duty++)
+    {
+        uint8_t expect[LEDS];
+        pwm_begin();
+        for (uint8_t led = 0; led < LEDS; led++)
+        {
+            expect[led] = duty ^ (led*13);
+            pwm_set(led, expect[led]);
+        }
+        pwm_commit();
+
+        /* New table replaces the old between frames */
+        run_frame(high);
+        frame = run_frame(high);
+
+        /* Every LED gets its duty of its anode's slot */
+        for (uint8_t led = 0; led < LEDS; led++)
+            TEST_ASSERT_EQUAL(expect[led], high[led]);
+    }
+
+    TEST_ASSERT_EQUAL(PINS*255, frame);
+    unsigned long cycles = (unsigned long)frame * (OCR1C+1);
+    TEST_PRINTF("charlie: %u LEDs on %u pins, %u interrupts per %luHz frame, worst duty error 0/255",
+                LEDS, PINS, 8*PINS, F_CPU/cycles);
+}
+
+void test_steady_sleep(void)
+{
+    unsigned high[LEDS];
+
+    /* Nothing lit, so TIMER1 may stop */
+    for (uint8_t led = 0; led < LEDS; led++)
+        pwm_set(led, 0);
+    TEST_ASSERT_FALSE(pwm_task_awake());
+    run_frame(high);
+    run_frame(high);
+    for (uint8_t led = 0; led < LEDS; led++)
+        TEST_ASSERT_EQUAL(0, high[led]);
+
+    /* Even fully ON needs scanning, so wake to keep TIMER1 running */
+    notified = 0;
+    pwm_set(7, 0xFF);
+    TEST_ASSERT_EQUAL(1, notified);
+    TEST_ASSERT_TRUE(pwm_task_awake());
+}
@@ -0,0 +1,111 @@
+/*! \file test_pwm_gamma.c
+ *
+ *  \brief Gamma corrected Pulse Width Modulation unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration. Including it by
+ * macro stops pwm.c being linked with the usual one.
+ */
+#define PWM_CONFIG "pwm_gamma.config"
+#define PWM_SOURCE "../../lib/pwm.c"
+#include PWM_SOURCE
+
+/** avr/io.h mock */
+unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+unsigned char TCCR1, GTCCR, OCR1A, OCR1B, OCR1C;
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+/** task.c mock */
+static bool stay_awake;     /**< task_stay_awake() called */
+
+void task_stay_awake(void)
+{
+    stay_awake = true;
+}
+
+static unsigned notified;   /**< task_notify() calls */
+
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(TASK_CYCLE(pwm_task), task);
+    notified++;
+}
+
+
+void setUp(void)
+{
+    TASK_CYCLE(pwm_task)(TASK_STARTUP);
+}
+
+void tearDown(void)
+{
+    TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
+}
+
+void test_table(void)
+{
+    /* Every engine shares pwm_common.h's table, so it's only tested here */
+
+    /* Fully OFF and ON are untouched */
+    TEST_ASSERT_EQUAL(0, pwm_gamma[0]);
+    TEST_ASSERT_EQUAL(255, pwm_gamma[255]);
+
+    /* Brighter is never dimmer, and only the darkest levels round to OFF */
+    for (unsigned brightness = 1; brightness < 256; brightness++)
+        TEST_ASSERT_TRUE(pwm_gamma[brightness] >= pwm_gamma[brightness-1]);
+    TEST_ASSERT_EQUAL(0, pwm_gamma[14]);
+    TEST_ASSERT_EQUAL(1, pwm_gamma[15]);
+
+    /* Half brightness needs about a fifth of the duty */
+    TEST_ASSERT_EQUAL(56, pwm_gamma[128]);
+}
+
+void test_corrected(void)
+{
+    /* Output is corrected, but reads back as set */
+    pwm_set(3, 128);
+    TEST_ASSERT_EQUAL(56, OCR1B);
+    TEST_ASSERT_EQUAL(128, pwm_get(3));
+
+    pwm_begin();
+    pwm_set(0, 255);
+    pwm_set(3, 255);
+    pwm_commit();
+    TEST_ASSERT_EQUAL(255, OCR1B);
+    TEST_ASSERT_EQUAL(255, pwm_duty[0]);
+}
+
+void test_only_set_converted(void)
+{
+    /* A channel not set isn't converted again, so keeps a planted duty */
+    pwm_duty[1] = 99;
+    pwm_set(0, 128);
+    TEST_ASSERT_EQUAL(56, pwm_duty[0]);
+    TEST_ASSERT_EQUAL(99, pwm_duty[1]);
+
+    /* A batch converts each channel set in it once, at commit */
+    pwm_begin();
+    pwm_set(2, 128);
+    pwm_set(2, 255);
+    pwm_set(3, 128);
+    TEST_ASSERT_EQUAL(0, pwm_duty[2]);
+    pwm_commit();
+    TEST_ASSERT_EQUAL(255, pwm_duty[2]);
+    TEST_ASSERT_EQUAL(56, OCR1B);
+    TEST_ASSERT_EQUAL(99, pwm_duty[1]);
+}
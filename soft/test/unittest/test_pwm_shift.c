@@ -0,0 +1,307 @@
+/*! \file test_pwm_shift.c
+ *
+ *  \brief Shift register Pulse Width Modulation unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration. Including it by
+ * macro stops pwm.c being linked too.
+ */
+#define F_CPU 16500000UL
+#define PWM_CONFIG "pwm_shift.config"
+#define PWM_SHIFT_SOURCE "../../lib/pwm_shift.c"
+#include PWM_SHIFT_SOURCE
+
+#include <string.h>
+
+/** TIMER0 interrupt enable, which belongs to the scheduler */
+#define OCIE0A 4
+
+/** avr/io.h mock */
+unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+unsigned char TCCR1, GTCCR, OCR1A, OCR1B, OCR1C, TIMSK;
+unsigned char mock_usicr[1], mock_usidr[1];
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+/** task.c mock */
+static bool stay_awake;     /**< task_stay_awake() called */
+
+void task_stay_awake(void)
+{
+    stay_awake = true;
+}
+
+static unsigned notified;   /**< task_notify() calls */
+
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(TASK_CYCLE(pwm_task), task);
+    notified++;
+}
+
+/**
+ * @brief Run pwm_task() once
+ * @return whether it kept the CPU from powering down
+ */
+static bool pwm_task_awake(void)
+{
+    stay_awake = false;
+    TASK_CYCLE(pwm_task)(1);
+    return stay_awake;
+}
+
+#define CHANNELS 32     /**< matches ../stubs/pwm_shift.config */
+
+#define DO (1<<1)
+#define USCK (1<<2)
+#define LATCH (1<<4)
+
+/** 74HC595 chain, bit n being channel n once it's all shifted in */
+static uint32_t chain;
+static unsigned clocks;
+static unsigned char shift_tccr1;   /**< TCCR1 when shifting began */
+
+/**
+ * @brief Act on the last value written to USICR, as the USI and the shift
+ * register chain would
+ * @return index of the USI register mocks
+ */
+unsigned mock_usi_access(void)
+{
+    uint8_t control = mock_usicr[0];
+
+    if (control & ((1<<USITC)|(1<<USICLK)))
+    {
+        /* Three-wire mode, clocked by software strobes */
+        TEST_ASSERT_EQUAL(1<<USIWM0, control & ~((1<<USITC)|(1<<USICLK)));
+        TEST_ASSERT_FALSE(PORTB & LATCH);
+    }
+
+    /* USITC toggles USCK, and the chain shifts in DO on its rising edge */
+    if (control & (1<<USITC))
+    {
+        PORTB ^= USCK;
+        if (PORTB & USCK)
+        {
+            if (!clocks)
+                shift_tccr1 = TCCR1;
+            chain = (chain << 1) | (mock_usidr[0] >> 7);
+            clocks++;
+        }
+    }
+
+    /* USICLK shifts USIDR, so the next bit is on DO */
+    if (control & (1<<USICLK))
+        mock_usidr[0] <<= 1;
+
+    /* Strobes always read as zero */
+    mock_usicr[0] = control & ~((1<<USITC)|(1<<USICLK));
+    return 0;
+}
+
+/**
+ * @brief Run a TIMER1 interrupt
+ * @return the outputs it latched
+ */
+static uint32_t run_interrupt(void)
+{
+    clocks = 0;
+    mock_gpio_port_writes = 0;
+    MOCK_IRQ(TIMER1_COMPA_vect)();
+    (void)mock_usi_access();
+
+    /* Plane timed before it was shifted in */
+    TEST_ASSERT_EQUAL_HEX8(TCCR1, shift_tccr1);
+
+    /* Every channel shifted in, USCK back low, then one latch pulse */
+    TEST_ASSERT_EQUAL(CHANNELS, clocks);
+    TEST_ASSERT_FALSE(PORTB & USCK);
+    TEST_ASSERT_EQUAL(2, mock_gpio_port_writes);
+    TEST_ASSERT_FALSE(PORTB & LATCH);
+    return chain;
+}
+
+/**
+ * CPU cycles from a comparison to its interrupt programming TIMER1: the
+ * response, jump and register saves. An estimate, as the host can't count
+ * AVR cycles.
+ */
+#define ISR_TIMER_CYCLES 40
+
+static unsigned timer_clock;    /**< TIMER1 clock select of the last plane */
+
+/**
+ * @brief Run TIMER1 interrupts for one whole frame
+ * @param high returns CPU cycles each channel was ON
+ * @return CPU cycles in the frame
+ */
+static unsigned run_frame(unsigned* high)
+{
+    unsigned cycles = 0;
+    memset(high, 0, CHANNELS*sizeof(high[0]));
+
+    for (unsigned i = 0; i < 8; i++)
+    {
+        uint32_t outputs = run_interrupt();
+
+        /* Until the interrupt programs the plane's clock select, TIMER1
+         * counts at the last plane's. Each latch comes the same time after
+         * its comparison, so the outputs last as long as the plane.
+         */
+        unsigned last = 1u << (timer_clock-1);
+        timer_clock = TCCR1 & 0x0F;
+        unsigned divider = 1u << (timer_clock-1);
+        unsigned period = (OCR1C+1u)*divider + ISR_TIMER_CYCLES - ISR_TIMER_CYCLES*divider/last;
+        cycles += period;
+
+        for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        {
+            if (outputs & (1ul << channel))
+                high[channel] += period;
+        }
+    }
+
+    return cycles;
+}
+
+void setUp(void)
+{
+    DDRB = 0;
+    PORTB = 0xFF;
+    TIMSK = 1<<OCIE0A;
+
+    TASK_CYCLE(pwm_task)(TASK_STARTUP);
+    timer_clock = TCCR1 & 0x0F;
+
+    /* DO, USCK and latch are outputs, idling low */
+    TEST_ASSERT_EQUAL(DO|USCK|LATCH, DDRB);
+    TEST_ASSERT_EQUAL(0xFF^(DO|USCK|LATCH), PORTB);
+    TEST_ASSERT_EQUAL(1<<USIWM0, mock_usicr[0]);
+
+    /* TIMER1 CTC interrupt, scheduler's left alone */
+    TEST_ASSERT_EQUAL((1<<OCIE0A)|(1<<OCIE1A), TIMSK);
+    TEST_ASSERT_EQUAL(OCR1C, OCR1A);
+    TEST_ASSERT_TRUE(TCCR1 & (1<<CTC1));
+}
+
+void tearDown(void)
+{
+    chain = 0xFFFFFFFF;
+    clocks = 0;
+    mock_gpio_port_writes = 0;
+    DDRB = 0xFF;
+
+    TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
+    (void)mock_usi_access();
+
+    /* Every output latched OFF, as the registers hold them */
+    TEST_ASSERT_EQUAL(CHANNELS, clocks);
+    TEST_ASSERT_EQUAL(0, chain);
+    TEST_ASSERT_EQUAL(2, mock_gpio_port_writes);
+
+    /* Disable outputs */
+    TEST_ASSERT_EQUAL(0xFF^(DO|USCK|LATCH), DDRB);
+    TEST_ASSERT_EQUAL(0, mock_usicr[0]);
+
+    /* TIMER1 stopped */
+    TEST_ASSERT_EQUAL(1<<OCIE0A, TIMSK);
+    TEST_ASSERT_EQUAL(0, TCCR1);
+}
+
+void test_set_get(void)
+{
+    /* Only 32 PWM channels defined */
+    for (unsigned i = 0; i < CHANNELS; i++)
+        pwm_set(i, i*7);
+    /* Setting others is No-Op */
+    for (unsigned i = CHANNELS; i < 256; i++)
+        pwm_set(i, 44);
+
+    for (unsigned i = 0; i < CHANNELS; i++)
+        TEST_ASSERT_EQUAL(i*7, pwm_get(i));
+    /* Fetching non-existent channels */
+    for (unsigned i = CHANNELS; i < 256; i++)
+        TEST_ASSERT_EQUAL(0, pwm_get(i));
+}
+
+void test_every_duty(void)
+{
+    unsigned high[CHANNELS];
+    unsigned frame = 0;
+    unsigned worst = 0;
+    /* CTC up to OCR1C, clock select n divides by 2^(n-1) */
+    unsigned unit = (OCR1C+1u) << (PWM_SHIFT_CLOCK_SELECT-1);
+
+    /* Other pins on the port are left alone */
+    PORTB |= 1<<0;
+
+    for (unsigned duty = 0; duty < 256; duty++)
+    {
+        uint8_t expect[CHANNELS];
+        pwm_begin();
+        for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        {
+            expect[channel] = duty ^ (channel*13);
+            pwm_set(channel, expect[channel]);
+        }
+        pwm_commit();
+
+        /* New table replaces the old between frames */
+        run_frame(high);
+        frame = run_frame(high);
+
+        /* Within a step of the duty, allowing for the interrupt */
+        for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        {
+            unsigned want = expect[channel]*unit;
+            unsigned error = (high[channel] > want) ? high[channel] - want : want - high[channel];
+            TEST_ASSERT_LESS_THAN(unit, error);
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    TEST_ASSERT_TRUE(PORTB & (1<<0));
+    TEST_ASSERT_UINT_WITHIN(unit, 255*unit, frame);
+    TEST_PRINTF("shift: %u channels, 8 interrupts per %luHz frame, worst duty error %u.%02u/255",
+                CHANNELS, F_CPU/frame, worst/unit, worst*100/unit % 100);
+}
+
+void test_steady_sleep(void)
+{
+    unsigned high[CHANNELS];
+
+    /* Nothing dimmed, but keep TIMER1 running until that's latched */
+    pwm_begin();
+    for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        pwm_set(channel, (channel & 1) ? 0xFF : 0);
+    pwm_commit();
+    TEST_ASSERT_TRUE(pwm_task_awake());
+
+    /* Then the registers hold it, so TIMER1 may stop */
+    TEST_ASSERT_EQUAL(0xAAAAAAAA, run_interrupt());
+    TEST_ASSERT_FALSE(pwm_task_awake());
+    unsigned frame = run_frame(high);
+    for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        TEST_ASSERT_EQUAL((channel & 1) ? frame : 0, high[channel]);
+
+    /* One channel dimmed, so wake to keep TIMER1 running */
+    notified = 0;
+    pwm_set(5, 0x80);
+    TEST_ASSERT_EQUAL(1, notified);
+    TEST_ASSERT_TRUE(pwm_task_awake());
+}
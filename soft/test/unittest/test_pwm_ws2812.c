@@ -0,0 +1,253 @@
+/*! \file test_pwm_ws2812.c
+ *
+ *  \brief WS2812 strip output unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built here with its own configuration, at the slowest
+ * clock it supports. Including it by macro stops pwm.c being linked too.
+ */
+#define F_CPU 8000000UL
+#define PWM_CONFIG "pwm_ws2812.config"
+#define PWM_WS2812_SOURCE "../../lib/pwm_ws2812.c"
+#include PWM_WS2812_SOURCE
+
+#include <string.h>
+
+/** avr/io.h mock */
+unsigned char PORTA, DDRA, PORTB, DDRB, PORTC, DDRC;
+
+/** gpio.h mock */
+unsigned mock_gpio_port_writes;
+
+#define LEDS 8              /**< matches ../stubs/pwm_ws2812.config */
+#define CHANNELS (3*LEDS)
+#define DATA (1<<0)
+
+/** Nanoseconds of some CPU cycles */
+#define NS(f_cpu_, cycles_) ((unsigned)((cycles_) * 1000000000ull / (f_cpu_)))
+
+/** interrupt.h mock */
+static bool interrupts = true;
+void mock_cli(void)
+{
+    interrupts = false;
+}
+void mock_sei(void)
+{
+    interrupts = true;
+}
+
+/** task.h mock */
+static unsigned notified;
+void task_notify(task_cycle task)
+{
+    TEST_ASSERT_EQUAL_PTR(pwm_task, task);
+    notified++;
+}
+
+/** Level of the data pin during each cycle streamed */
+static uint8_t trace[4096];
+static unsigned traced;
+
+void mock_ws2812_cycles(uint8_t cycles)
+{
+    /* Nothing may stretch the timing */
+    TEST_ASSERT_FALSE(interrupts);
+
+    TEST_ASSERT_TRUE(traced + cycles <= sizeof(trace));
+    memset(&trace[traced], PORTB & DATA, cycles);
+    traced += cycles;
+}
+
+/**
+ * @brief Decode the bits streamed, checking their timing
+ * @param bytes returns bytes streamed
+ * @param longest returns the longest low between bits in ns
+ * @return bits streamed
+ */
+static unsigned decode(uint8_t* bytes, unsigned* longest)
+{
+    unsigned bits = 0;
+    unsigned i = 0;
+    *longest = 0;
+
+    /* Starts low, from the reset */
+    TEST_ASSERT_TRUE(traced > 0);
+    TEST_ASSERT_FALSE(trace[0]);
+
+    while (i < traced)
+    {
+        while (i < traced && !trace[i])
+            i++;
+        if (i == traced)
+            break;
+
+        unsigned rise = i;
+        while (i < traced && trace[i])
+            i++;
+        unsigned high = NS(F_CPU, i - rise);
+
+        /* Every bit's low is too short for the strip to reset */
+        unsigned fall = i;
+        while (i < traced && !trace[i])
+            i++;
+        if (i < traced)
+        {
+            unsigned low = NS(F_CPU, i - fall);
+            TEST_ASSERT_TRUE(low >= 450);
+            TEST_ASSERT_TRUE(low < 5000);
+            if (low > *longest)
+                *longest = low;
+        }
+
+        /* Short high is 0, long is 1, within WS2812 and WS2812B tolerances */
+        bool one = high >= 650;
+        if (one)
+            TEST_ASSERT_TRUE(high <= 850);
+        else
+            TEST_ASSERT_TRUE(high >= 250 && high <= 500);
+
+        bytes[bits/8] = (bytes[bits/8] << 1) | one;
+        bits++;
+    }
+
+    /* Ends low, so the strip latches */
+    TEST_ASSERT_FALSE(trace[traced-1]);
+    return bits;
+}
+
+void setUp(void)
+{
+    DDRB = 0;
+    PORTB = 0xFF;
+
+    TASK_CYCLE(pwm_task)(TASK_STARTUP);
+
+    /* Data pin's an output, low */
+    TEST_ASSERT_EQUAL(DATA, DDRB);
+    TEST_ASSERT_EQUAL(0xFF^DATA, PORTB);
+
+    /* The strip's state is unknown, so it's streamed first */
+    traced = 0;
+    TEST_ASSERT_TRUE(TASK_CYCLE(pwm_task)(1) > 16);
+    TEST_ASSERT_EQUAL(0xFF^DATA, PORTB);
+    TEST_ASSERT_TRUE(interrupts);
+    TEST_ASSERT_TRUE(traced > 0);
+    traced = 0;
+    notified = 0;
+}
+
+void tearDown(void)
+{
+    uint8_t bytes[CHANNELS];
+    unsigned longest;
+
+    traced = 0;
+    TASK_CYCLE(pwm_task)(TASK_SHUTDOWN);
+    TEST_ASSERT_TRUE(interrupts);
+
+    /* The strip would hold its colours, so every LED's turned OFF */
+    TEST_ASSERT_EQUAL(8*CHANNELS, decode(bytes, &longest));
+    for (uint8_t i = 0; i < CHANNELS; i++)
+        TEST_ASSERT_EQUAL(0, bytes[i]);
+
+    /* Disable output */
+    TEST_ASSERT_EQUAL(0, DDRB);
+}
+
+void test_set_get(void)
+{
+    /* Only 24 channels defined */
+    for (unsigned i = 0; i < CHANNELS; i++)
+        pwm_set(i, i*9);
+    /* Setting others is No-Op */
+    for (unsigned i = CHANNELS; i < 256; i++)
+        pwm_set(i, 44);
+
+    for (unsigned i = 0; i < CHANNELS; i++)
+        TEST_ASSERT_EQUAL(i*9, pwm_get(i));
+    /* Fetching non-existent channels */
+    for (unsigned i = CHANNELS; i < 256; i++)
+        TEST_ASSERT_EQUAL(0, pwm_get(i));
+}
+
+void test_stream(void)
+{
+    uint8_t bytes[CHANNELS];
+    unsigned longest;
+
+    /* Other pins on the port are left alone */
+    PORTB = 0xA0;
+
+    pwm_begin();
+    for (uint8_t led = 0; led < LEDS; led++)
+    {
+        pwm_set(3*led+0, 0x10 + led);   /* red */
+        pwm_set(3*led+1, 0x80 + led);   /* green */
+        pwm_set(3*led+2, 0xF0 + led);   /* blue */
+    }
+    TEST_ASSERT_EQUAL(0, notified);
+
+    /* Committing wakes pwm_task(), which streams the whole batch once */
+    pwm_commit();
+    TEST_ASSERT_EQUAL(1, notified);
+    TEST_ASSERT_EQUAL(0, traced);
+    TASK_CYCLE(pwm_task)(1);
+    TEST_ASSERT_TRUE(interrupts);
+    TEST_ASSERT_EQUAL(0xA0, PORTB);
+
+    /* Green, red then blue of each LED, MSB first */
+    TEST_ASSERT_EQUAL(8*CHANNELS, decode(bytes, &longest));
+    for (uint8_t led = 0; led < LEDS; led++)
+    {
+        TEST_ASSERT_EQUAL(0x80 + led, bytes[3*led+0]);
+        TEST_ASSERT_EQUAL(0x10 + led, bytes[3*led+1]);
+        TEST_ASSERT_EQUAL(0xF0 + led, bytes[3*led+2]);
+    }
+
+    unsigned long cycles = traced;
+    TEST_PRINTF("ws2812: %u LEDs streamed in %luus at %luHz, lows up to %uns",
+                LEDS, cycles * 1000000ul / F_CPU, F_CPU, longest);
+
+    /* Setting the same duties streams nothing */
+    traced = 0;
+    pwm_set(4, 0x81);
+    TASK_CYCLE(pwm_task)(1);
+    TEST_ASSERT_EQUAL(1, notified);
+    TEST_ASSERT_EQUAL(0, traced);
+}
+
+void test_clocks(void)
+{
+    static const unsigned long f_cpu[] = { 8000000, 9600000, 12000000, 16000000, 16500000, 20000000 };
+
+    /* Bits are in WS2812 and WS2812B tolerances, with padding to spare */
+    for (uint8_t i = 0; i < sizeof(f_cpu)/sizeof(f_cpu[0]); i++)
+    {
+        unsigned t0h = NS(f_cpu[i], PWM_WS2812_T0H(f_cpu[i]));
+        unsigned t1h = NS(f_cpu[i], PWM_WS2812_T1H(f_cpu[i]));
+        unsigned bit = NS(f_cpu[i], PWM_WS2812_BIT(f_cpu[i]));
+
+        TEST_ASSERT_TRUE(t0h >= 250 && t0h <= 500);
+        TEST_ASSERT_TRUE(t1h >= 650 && t1h <= 850);
+        TEST_ASSERT_TRUE(bit - t0h >= 650 && bit - t1h >= 450);
+        TEST_ASSERT_TRUE(bit >= 1150 && bit <= 1350);
+
+        TEST_ASSERT_TRUE((int)PWM_WS2812_D1(f_cpu[i]) >= 0);
+        TEST_ASSERT_TRUE((int)PWM_WS2812_D2(f_cpu[i]) >= 0);
+        TEST_ASSERT_TRUE((int)PWM_WS2812_D3(f_cpu[i]) >= 0);
+    }
+}
@@ -16,23 +16,29 @@
 
 #include "unity.h"  /* Framework */
 
-#include "task.h"    /* Module under test */
+/* Module under test. Including it by macro stops task.c being linked, so
+ * test_task_profile.c can build it again with profiling.
+ */
+#define TASK_SOURCE "../../lib/task.c"
+#include TASK_SOURCE
 
-#include "../stubs/avr/interrupt.h"
-#include "../stubs/avr/pgmspace.h"
-#include "../stubs/avr/sleep.h"
+#include "../stubs/avr/eeprom.h"
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 ISR(TIMER0_COMPA_vect);
+ISR(WDT_vect);
 
 unsigned char TCCR0A;
 unsigned char TCCR0B;
 unsigned char TCNT0;
 unsigned char OCR0A;
 unsigned char TIMSK;
+unsigned char TIFR;
+unsigned char WDTCR;
+unsigned char MCUSR;
 
 unsigned F_CPU;
 
@@ -40,11 +46,13 @@ static bool interrupts_enabled;
 static bool sleep_enabled;
 static enum sleep_mode sleep_mode_selected;
 static bool powered_down;
+static uint8_t eeprom[E2END+1];
 
 /**
  * Pointers to test tasks
  */
 static task_cycle test_task[3];
+static task_cycle16 test_task16;
 
 /* We use local functions in test_task[] which triggers a trampoline
  * warning.
@@ -62,9 +70,109 @@ static uint8_t dummy_task(uint8_t ignored)
 }
 
 /**
- * Incrementing simulated milliseconds
+ * @brief Idle task that never asks to be called
+ * @param ignored
+ * @return longest sleep
+ */
+static uint8_t idle_task(uint8_t ignored)
+{
+    return TASK_STARTUP-1;
+}
+
+/**
+ * @brief Idle 16-bit task that never asks to be called
+ * @param ignored
+ * @return longest sleep
+ */
+static uint16_t idle_task16(uint16_t ignored)
+{
+    return TASK_STARTUP16-1;
+}
+
+/**
+ * Simulated CPU cycles, advanced by TIMER0 running to Compare Match
+ */
+static uint64_t cycles_timer;
+
+/**
+ * Simulated CPU cycles towards the next TIMER0 count
+ */
+static uint32_t cycles_partial;
+
+/**
+ * Number of TIMER0 Compare Match interrupts taken
+ */
+static unsigned interrupt_count;
+
+/**
+ * Number of watchdog interrupts taken, and simulated CPU cycles spent
+ * powered down waiting for them
  */
-static unsigned milliseconds_timer;
+static unsigned wdt_count;
+static uint64_t cycles_powered_down;
+
+/**
+ * Number of task pointers read from flash
+ */
+static unsigned flash_reads;
+
+/**
+ * Simulated interrupt handler to call while sleeping, and when
+ */
+static void (*sleep_event)(void);
+static uint64_t sleep_event_cycles;
+
+/**
+ * @brief Convert simulated CPU cycles to nearest whole milliseconds
+ * @param cycles of F_CPU
+ * @return milliseconds
+ */
+static unsigned milliseconds(uint64_t cycles)
+{
+    return (cycles + F_CPU/2000)/(F_CPU/1000);
+}
+
+/**
+ * @brief Decode TIMER0 clock prescaler
+ * @return F_CPU cycles per timer count or 0 if stopped
+ */
+static uint32_t timer_prescale(void)
+{
+    static const uint32_t scale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    return scale[TCCR0B & 7];
+}
+
+/**
+ * @brief Take a pending TIMER0 Compare Match interrupt, if interrupts are on
+ */
+static void timer_interrupt(void)
+{
+    if (interrupts_enabled && (TIFR & (1<<OCF0A)))
+    {
+        TIFR &= ~(1<<OCF0A);
+        interrupt_count++;
+        MOCK_IRQ(TIMER0_COMPA_vect)();
+    }
+}
+
+/**
+ * @brief Simulate TIMER0 counting while the CPU is busy running tasks
+ * @param cycles of F_CPU to run
+ */
+static void timer_run(uint32_t cycles)
+{
+    cycles_timer += cycles;
+    cycles_partial += cycles;
+    while (cycles_partial >= timer_prescale())
+    {
+        cycles_partial -= timer_prescale();
+        if (++TCNT0 == OCR0A)
+        {
+            TIFR |= 1<<OCF0A;
+            timer_interrupt();
+        }
+    }
+}
 
 void setUp(void)
 {
@@ -73,6 +181,9 @@ void setUp(void)
     TCNT0 = 0;
     OCR0A = 0;
     TIMSK = 0;
+    TIFR = 0;
+    WDTCR = 0;
+    MCUSR = 1<<WDRF;
 
     F_CPU = 16500000;
 
@@ -80,9 +191,18 @@ void setUp(void)
     sleep_enabled = false;
     sleep_mode_selected = 0;
     powered_down = false;
+    cycles_timer = 0;
+    cycles_partial = 0;
+    interrupt_count = 0;
+    wdt_count = 0;
+    cycles_powered_down = 0;
+    sleep_event = NULL;
+    flash_reads = 0;
+    (void)memset(eeprom, 0xFF, sizeof(eeprom));
     test_task[0] = dummy_task;
     test_task[1] = dummy_task;
     test_task[2] = dummy_task;
+    test_task16 = idle_task16;
 }
 
 void tearDown(void)
@@ -95,17 +215,166 @@ void test_timer_configuration(void)
     task_main();
 
     /* Check timer configuration */
-    TEST_ASSERT_EQUAL(0x02, TCCR0A);    /* Reset on Compare Match */
+    TEST_ASSERT_EQUAL(0x00, TCCR0A);    /* Free running */
     TEST_ASSERT_EQUAL(0x10, TIMSK);     /* Interrupt on Compare Match */
+    TEST_ASSERT_TRUE_MESSAGE(timer_prescale() != 0, "bad clock");
+
+    /* Watchdog must not reset the chip */
+    TEST_ASSERT_EQUAL(0, MCUSR & (1<<WDRF));
+    TEST_ASSERT_EQUAL(0, WDTCR & (1<<WDE));
+}
+
+void test_timer_period(void)
+{
+    /* Callbacks */
+    uint8_t task(uint8_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP:
+            return 1;
+
+        case 1:
+            /* Compare Match should be ~1ms, 1% tolerance */
+            TEST_ASSERT_UINT32_WITHIN(F_CPU/100000, F_CPU/1000, cycles_timer);
+            cycles_timer = 0;
+            return 200;
+
+        case 200:
+            TEST_ASSERT_UINT32_WITHIN(F_CPU/100000, F_CPU/5, cycles_timer);
+            /*FALLTHRU*/
+        default:
+            return TASK_SHUTDOWN;
+        }
+    }
+
+    test_task[0] = task;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+}
+
+void test_tickless_interrupts(void)
+{
+    static unsigned elapsed_ms;
+
+    /* Callbacks */
+    uint8_t slow(uint8_t ms_later)
+    {
+        if (ms_later != TASK_STARTUP)
+            elapsed_ms += ms_later;
+        return (elapsed_ms < 1000) ? 250 : TASK_SHUTDOWN;
+    }
+    uint8_t fast(uint8_t ms_later)
+    {
+        if (ms_later != TASK_STARTUP)
+            elapsed_ms += ms_later;
+        return (elapsed_ms < 1000) ? 1 : TASK_SHUTDOWN;
+    }
+    uint8_t idle(uint8_t ms_later)
+    {
+        return 250;
+    }
 
-    /* Calculate timer period */
-    int prescale = TCCR0B & 7;
-    uint32_t scale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
-    TEST_ASSERT_TRUE_MESSAGE(scale[prescale] != 0, "bad clock");
-    uint32_t ns = (1000000000 / (F_CPU / scale[prescale])) * (OCR0A+1);
+    /* A 1ms task needs an interrupt every millisecond */
+    elapsed_ms = 0;
+    test_task[0] = fast;
+    test_task[1] = idle;
+    test_task[2] = idle;
+    task_main();
+    TEST_ASSERT_EQUAL(1000, interrupt_count);
+    TEST_ASSERT_EQUAL(0, wdt_count);
+    TEST_ASSERT_EQUAL(1000, milliseconds(cycles_timer));
+    TEST_PRINTF("1ms task: %u interrupts/s", interrupt_count);
+
+    /* A 250ms task powers down for 128+64+32+16ms, then the 1ms comparison
+     * that covers the tasks running is chained to the remaining 9ms
+     */
+    setUp();
+    elapsed_ms = 0;
+    test_task[0] = slow;
+    test_task[1] = idle;
+    test_task[2] = idle;
+    task_main();
+    TEST_ASSERT_EQUAL(4*2, interrupt_count);
+    TEST_ASSERT_EQUAL(4*4, wdt_count);
+    TEST_ASSERT_EQUAL(1000, milliseconds(cycles_timer));
+    TEST_PRINTF("250ms task: %u interrupts/s", interrupt_count+wdt_count);
+}
+
+void test_power_down(void)
+{
+    static unsigned elapsed_ms;
+    static uint8_t blink_ms;
+
+    /* Callbacks */
+    uint8_t doze(uint8_t ms_later)
+    {
+        if (ms_later != TASK_STARTUP)
+            elapsed_ms += ms_later;
+        return (elapsed_ms < 1000) ? 250 : TASK_SHUTDOWN;
+    }
+    uint8_t blink(uint8_t ms_later)
+    {
+        return blink_ms;
+    }
+
+    /* Like a PWM channel mid-cycle: the pending 1ms comparison leaves less
+     * than the shortest watchdog period, so we can't power down
+     */
+    elapsed_ms = 0;
+    blink_ms = 16;
+    test_task[0] = doze;
+    test_task[1] = blink;
+    test_task[2] = blink;
+    task_main();
+    TEST_ASSERT_EQUAL(1000, milliseconds(cycles_timer));
+    TEST_ASSERT_EQUAL(0, wdt_count);
 
-    /* 1% tolerance */
-    TEST_ASSERT_UINT32_WITHIN(10000, 1000000, ns);
+    /* Steady, so all but 10ms of each doze is powered down */
+    setUp();
+    elapsed_ms = 0;
+    blink_ms = 250;
+    test_task[0] = doze;
+    test_task[1] = blink;
+    test_task[2] = blink;
+    task_main();
+    TEST_ASSERT_EQUAL(1000, milliseconds(cycles_timer));
+    TEST_ASSERT_EQUAL(4*240, milliseconds(cycles_powered_down));
+    TEST_PRINTF("powered down %ums of %ums", milliseconds(cycles_powered_down), milliseconds(cycles_timer));
+}
+
+void test_stay_awake(void)
+{
+    static unsigned elapsed_ms;
+
+    /* Callbacks */
+    uint8_t dimmed(uint8_t ms_later)
+    {
+        if (ms_later != TASK_STARTUP)
+            elapsed_ms += ms_later;
+
+        /* Like a PWM engine while TIMER1 is dimming a channel */
+        if (elapsed_ms < 1000)
+            task_stay_awake();
+        return (elapsed_ms < 2000) ? 250 : TASK_SHUTDOWN;
+    }
+    uint8_t steady(uint8_t ms_later)
+    {
+        return 250;
+    }
+
+    /* Only idles for the first second, then powers down as usual */
+    elapsed_ms = 0;
+    test_task[0] = dimmed;
+    test_task[1] = steady;
+    test_task[2] = steady;
+    task_main();
+    TEST_ASSERT_EQUAL(2000, milliseconds(cycles_timer));
+    TEST_ASSERT_EQUAL(4*240, milliseconds(cycles_powered_down));
+
+    /* Outside a task it does nothing */
+    task_stay_awake();
 }
 
 void test_startup_shutdown(void)
@@ -163,16 +432,20 @@ void test_schedule_requests(void)
     {
         switch(ms_later)
         {
-        case 1:
-            TEST_ASSERT_EQUAL(1, milliseconds_timer);
-            milliseconds_timer = 0;
-            return 2;       /* trigger task 2 */
-
         case TASK_STARTUP:
+            TEST_ASSERT_EQUAL(0, milliseconds(cycles_timer));
+            return 2;
+
         case 2:
-        case 3:
+            TEST_ASSERT_EQUAL(2, milliseconds(cycles_timer));
+            return 3;
+
+        case 3:             /* test complete */
+            TEST_ASSERT_EQUAL(5, milliseconds(cycles_timer));
+            return TASK_SHUTDOWN;
+
         case TASK_SHUTDOWN:
-            return 100;     /* idle */
+            return 100;
 
         default:
             TEST_FAIL_MESSAGE("unexpected ms_later");
@@ -182,16 +455,15 @@ void test_schedule_requests(void)
     {
         switch(ms_later)
         {
-        case 2:
-            TEST_ASSERT_EQUAL(2, milliseconds_timer);
-            milliseconds_timer = 0;
-            return 3;       /* trigger task 3 */
-
         case TASK_STARTUP:
-        case 1:
-        case 3:
+            return 5;
+
+        case 5:             /* only called once its own sleep is over */
+            TEST_ASSERT_EQUAL(5, milliseconds(cycles_timer));
+            return 100;
+
         case TASK_SHUTDOWN:
-            return 200;     /* idle */
+            return 200;
 
         default:
             TEST_FAIL_MESSAGE("unexpected ms_later");
@@ -202,20 +474,18 @@ void test_schedule_requests(void)
         switch(ms_later)
         {
         case TASK_STARTUP:
-            TEST_ASSERT_EQUAL(0, milliseconds_timer);
-            return 1;       /* Trigger task 1 */
+            return 1;
 
-        case 3:             /* test complete */
-            TEST_ASSERT_EQUAL(3, milliseconds_timer);
-            milliseconds_timer = 0;
-            return TASK_SHUTDOWN;
+        case 1:
+            TEST_ASSERT_EQUAL(1, milliseconds(cycles_timer));
+            return 4;
+
+        case 4:             /* accumulated over other tasks' wakes */
+            TEST_ASSERT_EQUAL(5, milliseconds(cycles_timer));
+            return 100;
 
         case TASK_SHUTDOWN:
-            TEST_ASSERT_EQUAL(0, milliseconds_timer);
-            /*FALLTHRU*/
-        case 1:
-        case 2:
-            return 250;     /* idle */
+            return 250;
 
         default:
             TEST_FAIL_MESSAGE("unexpected ms_later");
@@ -226,10 +496,448 @@ void test_schedule_requests(void)
     test_task[0] = task1;
     test_task[1] = task2;
     test_task[2] = task3;
-    milliseconds_timer = 0;
     task_main();
 }
 
+void test_due_dispatch(void)
+{
+    static unsigned calls[3];
+    static unsigned elapsed_ms, cycles;
+
+    /* Callbacks: a 1ms task like pwm_task and two idle tasks */
+    uint8_t fast(uint8_t ms_later)
+    {
+        calls[0]++;
+        if (ms_later == TASK_STARTUP || ms_later == TASK_SHUTDOWN)
+            return 1;
+        cycles++;
+        elapsed_ms += ms_later;
+        return (elapsed_ms < 1000) ? 1 : TASK_SHUTDOWN;
+    }
+    uint8_t idle1(uint8_t ms_later)
+    {
+        calls[1]++;
+        return 255;
+    }
+    uint8_t idle2(uint8_t ms_later)
+    {
+        calls[2]++;
+        return 100;
+    }
+
+    (void)memset(calls, 0, sizeof(calls));
+    elapsed_ms = cycles = 0;
+    test_task[0] = fast;
+    test_task[1] = idle1;
+    test_task[2] = idle2;
+    task_main();
+
+    /* Without the due table every task is called on every wake */
+    unsigned before = 3*(cycles+2);
+    unsigned after = calls[0]+calls[1]+calls[2];
+    TEST_PRINTF("calls per simulated second: %u before, %u after", before, after);
+
+    /* Each call is a flash read and indirect call, unless built with
+     * TASK_STATIC, including the idle 16-bit task at startup and shutdown
+     */
+    TEST_ASSERT_EQUAL(after+2, flash_reads);
+    TEST_PRINTF("flash reads per simulated second: %u", flash_reads);
+
+    TEST_ASSERT_EQUAL(cycles+2, calls[0]);
+    TEST_ASSERT_EQUAL(2+1000/254, calls[1]);
+    TEST_ASSERT_EQUAL(2+1000/100, calls[2]);
+}
+
+void test_overrun(void)
+{
+    /* Callbacks */
+    uint8_t task(uint8_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP:
+            return 10;
+
+        case 10:
+            /* Busy for longer than the next task asked to sleep */
+            timer_run(F_CPU/1000*7+F_CPU/2000);
+            return 5;
+
+        case 7:
+            /* Next delay is measured from the last wake, not from when
+             * the tasks finished
+             */
+            TEST_ASSERT_EQUAL(17, milliseconds(cycles_timer));
+            return 20;
+
+        case 20:
+            TEST_ASSERT_EQUAL(37, milliseconds(cycles_timer));
+            /*FALLTHRU*/
+        default:
+            return TASK_SHUTDOWN;
+        }
+    }
+    uint8_t other(uint8_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP:
+            return 10;
+
+        case 10:
+            return 5;
+
+        case 7:
+            /* Only asked for 5 but tasks overran */
+            TEST_ASSERT_EQUAL(17, milliseconds(cycles_timer));
+            return 100;
+
+        default:
+            return 100;
+        }
+    }
+
+    test_task[0] = task;
+    test_task[1] = other;
+    test_task[2] = idle_task;
+    task_main();
+}
+
+void test_drift(void)
+{
+    static const unsigned clock[] = { 128000, 1000000, 8000000, 9600000, 12000000, 16000000, 16500000, 20000000 };
+    static const unsigned days = 2;
+    static uint64_t run_cycles;
+    static uint64_t task_ms;
+    static unsigned worst_ms;
+    static uint32_t lcg;
+
+    /* Callbacks */
+    uint8_t task(uint8_t ms_later)
+    {
+        if (ms_later == TASK_SHUTDOWN)
+            return TASK_SHUTDOWN;
+
+        /* Time seen by the task must track real time */
+        if (ms_later != TASK_STARTUP)
+            task_ms += ms_later;
+        unsigned real_ms = milliseconds(cycles_timer);
+        unsigned drift = (task_ms > real_ms) ? task_ms-real_ms : real_ms-task_ms;
+        TEST_ASSERT_LESS_OR_EQUAL_UINT(1, drift);
+        if (drift > worst_ms)
+            worst_ms = drift;
+
+        /* Burn some CPU, occasionally overrunning, and sleep a while */
+        lcg = lcg*1103515245u + 12345u;
+        timer_run((lcg>>16) % (F_CPU/300));
+        return (cycles_timer < run_cycles) ? 1+(lcg>>24)%254 : TASK_SHUTDOWN;
+    }
+    uint8_t idle(uint8_t ms_later)
+    {
+        return 254;
+    }
+
+    for (unsigned i = 0; i < sizeof(clock)/sizeof(clock[0]); i++)
+    {
+        setUp();
+        F_CPU = clock[i];
+        run_cycles = (uint64_t)days*24*60*60*F_CPU;
+        task_ms = 0;
+        worst_ms = 0;
+        lcg = i;
+        test_task[0] = task;
+        test_task[1] = idle;
+        test_task[2] = idle;
+        task_main();
+
+        TEST_PRINTF("%uHz: worst %ums drift over %u simulated days", F_CPU, worst_ms, days);
+    }
+}
+
+void test_interrupts_held_off(void)
+{
+    static const unsigned clock[] = { 8000000, 16500000 };
+    static const unsigned held_us[] = { 2550, 10000 };
+    static unsigned hold_us;
+    static uint64_t task_ms;
+    static unsigned calls;
+
+    /* Callbacks: like pwm_ws2812 streaming a long strip with interrupts
+     * off for several of the 1ms comparisons timing the tasks
+     */
+    uint8_t task(uint8_t ms_later)
+    {
+        if (ms_later == TASK_SHUTDOWN)
+            return TASK_SHUTDOWN;
+        if (ms_later != TASK_STARTUP)
+            task_ms += ms_later;
+        TEST_ASSERT_UINT_WITHIN(1, milliseconds(cycles_timer), task_ms);
+        cli();
+        timer_run((uint64_t)hold_us*F_CPU/1000000);
+        sei();
+        return (++calls < 1000) ? 1 : TASK_SHUTDOWN;
+    }
+
+    for (unsigned i = 0; i < sizeof(clock)/sizeof(clock[0]); i++)
+    {
+        for (unsigned j = 0; j < sizeof(held_us)/sizeof(held_us[0]); j++)
+        {
+            setUp();
+            F_CPU = clock[i];
+            hold_us = held_us[j];
+            task_ms = 0;
+            calls = 0;
+            test_task[0] = task;
+            test_task[1] = idle_task;
+            test_task[2] = idle_task;
+            task_main();
+
+            /* Every call checked no time was lost to the late interrupts */
+            TEST_ASSERT_EQUAL_UINT(1000, calls);
+            TEST_PRINTF("%uHz, interrupts off %uus a call: %ums timed of %ums",
+                        F_CPU, hold_us, (unsigned)task_ms, milliseconds(cycles_timer));
+        }
+    }
+}
+
+void test_long_sleep(void)
+{
+    static unsigned calls;
+
+    /* Callbacks */
+    uint16_t slow(uint16_t ms_later)
+    {
+        calls++;
+        switch(ms_later)
+        {
+        case TASK_STARTUP16:
+            return 5000;
+
+        case 5000:
+            TEST_ASSERT_EQUAL(5000, milliseconds(cycles_timer));
+            return 40000;   /* longer than a single delay */
+
+        case 40000:
+            TEST_ASSERT_EQUAL(45000, milliseconds(cycles_timer));
+            /*FALLTHRU*/
+        case TASK_SHUTDOWN:
+            return TASK_SHUTDOWN;
+
+        default:
+            TEST_FAIL_MESSAGE("unexpected ms_later");
+            return TASK_SHUTDOWN;
+        }
+    }
+
+    calls = 0;
+    test_task16 = slow;
+    test_task[0] = idle_task;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+
+    /* Only woken when due, despite the 8-bit tasks waking every 254ms */
+    TEST_ASSERT_EQUAL(4, calls);
+}
+
+void test_coroutine(void)
+{
+    static unsigned steps;
+    static uint8_t i;
+
+    /* Callbacks */
+    uint8_t sequence(uint8_t ms_later)
+    {
+        TASK_BEGIN(ms_later);
+
+        TEST_ASSERT_EQUAL(0, milliseconds(cycles_timer));
+        steps++;
+        TASK_SLEEP(10);
+        TEST_ASSERT_EQUAL(10, milliseconds(cycles_timer));
+        steps++;
+        for (i = 0; i < 3; i++)
+        {
+            TASK_SLEEP(20);
+            TEST_ASSERT_EQUAL(30+20*i, milliseconds(cycles_timer));
+            steps++;
+        }
+
+        TASK_END;
+    }
+    uint16_t stop(uint16_t ms_later)
+    {
+        TASK_BEGIN(ms_later);
+        TASK_SLEEP(1000);
+        TEST_ASSERT_EQUAL(1000, milliseconds(cycles_timer));
+        TASK_SLEEP(TASK_SHUTDOWN);
+        TASK_END;
+    }
+
+    steps = 0;
+    test_task16 = stop;
+    test_task[0] = sequence;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+
+    /* Ran through once, then idled and was not resumed at shutdown */
+    TEST_ASSERT_EQUAL(5, steps);
+}
+
+void test_notify(void)
+{
+    static unsigned calls;
+
+    /* Callbacks */
+    void event(void)
+    {
+        task_notify(test_task[0]);
+    }
+    uint8_t task(uint8_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP:
+            return 200;
+
+        case TASK_SHUTDOWN:
+            return TASK_SHUTDOWN;
+
+        default:
+            calls++;
+            if (calls == 1)
+            {
+                /* Woken at the next millisecond */
+                TEST_ASSERT_EQUAL(51, milliseconds(cycles_timer));
+                TEST_ASSERT_EQUAL(51, ms_later);
+                return 200;
+            }
+
+            /* Then back to its own schedule */
+            TEST_ASSERT_EQUAL(251, milliseconds(cycles_timer));
+            TEST_ASSERT_EQUAL(200, ms_later);
+            return TASK_SHUTDOWN;
+        }
+    }
+    uint8_t tick(uint8_t ms_later)
+    {
+        return 10;
+    }
+
+    /* Notified by an interrupt half way through a millisecond */
+    calls = 0;
+    sleep_event = event;
+    sleep_event_cycles = (uint64_t)F_CPU*505/10000;
+    test_task[0] = task;
+    test_task[1] = tick;
+    test_task[2] = idle_task;
+    task_main();
+    TEST_ASSERT_EQUAL(2, calls);
+    TEST_ASSERT_NULL(sleep_event);
+}
+
+void test_notify_power_down(void)
+{
+    static unsigned calls;
+
+    /* Callbacks */
+    void event(void)
+    {
+        task_notify(test_task[0]);
+    }
+    uint8_t task(uint8_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP:
+            return 200;
+
+        case TASK_SHUTDOWN:
+            return TASK_SHUTDOWN;
+
+        default:
+            /* The watchdog can't be read so elapsed time is approximate */
+            calls++;
+            TEST_ASSERT_EQUAL(61, milliseconds(cycles_timer));
+            TEST_ASSERT_UINT_WITHIN(64, 61, ms_later);
+            return TASK_SHUTDOWN;
+        }
+    }
+
+    calls = 0;
+    sleep_event = event;
+    sleep_event_cycles = (uint64_t)F_CPU*60/1000;
+    test_task[0] = task;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_EQUAL(1, wdt_count);
+    TEST_ASSERT_FALSE(WDTCR & (1<<WDIE));
+}
+
+void test_dormant(void)
+{
+    static unsigned calls;
+    static unsigned elapsed_ms;
+    static unsigned long idle_ms;
+
+    /* Callbacks: a fade with every channel at target, and an effect that
+     * wakes it after a long while
+     */
+    uint16_t fade(uint16_t ms_later)
+    {
+        switch(ms_later)
+        {
+        case TASK_STARTUP16:
+            return TASK_DORMANT16;
+
+        case TASK_SHUTDOWN:
+            return TASK_SHUTDOWN;
+
+        default:
+            /* Woken in the same cycle, as the effect comes first in
+             * priority order, after saturating its sleep
+             */
+            calls++;
+            TEST_ASSERT_EQUAL(100000, milliseconds(cycles_timer));
+            TEST_ASSERT_EQUAL(TASK_STARTUP16-1, ms_later);
+            return TASK_DORMANT16;
+        }
+    }
+    uint8_t effect(uint8_t ms_later)
+    {
+        if (ms_later != TASK_STARTUP)
+            elapsed_ms += ms_later;
+        if (elapsed_ms == 100000)
+            task_notify16(test_task16);
+        return (elapsed_ms < 120000) ? 250 : TASK_SHUTDOWN;
+    }
+
+    /* Powered down as long as the other tasks allow on their own */
+    elapsed_ms = 0;
+    test_task[0] = effect;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+    idle_ms = milliseconds(cycles_powered_down);
+
+    setUp();
+    calls = elapsed_ms = 0;
+    test_task16 = fade;
+    test_task[0] = effect;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+
+    /* Never called in steady state, nor does it cut the others' sleep short */
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_UINT_WITHIN(16, idle_ms, milliseconds(cycles_powered_down));
+    TEST_PRINTF("dormant task: %u calls in %us, powered down %ums of %ums",
+                calls, milliseconds(cycles_timer)/1000, milliseconds(cycles_powered_down),
+                milliseconds(cycles_timer));
+}
+
 void test_startup_once(void)
 {
     static bool startup[3];
@@ -269,16 +977,93 @@ void test_startup_once(void)
     TEST_ASSERT_TRUE(startup[2]);
 }
 
+void test_priority_order(void)
+{
+    static char order[8];
+    static unsigned calls;
+
+    /* Callbacks: an effect producing for a 16-bit fade, producing for PWM */
+    uint8_t task(char name, uint8_t ms_later)
+    {
+        if (ms_later == TASK_SHUTDOWN)
+            return TASK_SHUTDOWN;
+        order[calls++] = name;
+        return (calls < 8) ? 10 : TASK_SHUTDOWN;
+    }
+    uint8_t effect(uint8_t ms_later) { return task('e', ms_later); }
+    uint16_t fade(uint16_t ms_later) { return task('f', ms_later); }
+    uint8_t pwm(uint8_t ms_later) { return task('p', ms_later); }
+
+    /* Every cycle calls them in task list order, whatever their width */
+    (void)memset(order, 0, sizeof(order));
+    calls = 0;
+    test_task[0] = effect;
+    test_task16 = fade;
+    test_task[1] = pwm;
+    test_task[2] = idle_task;
+    task_main();
+    TEST_ASSERT_EQUAL_MEMORY("efpefpef", order, sizeof(order));
+}
+
+/**
+ * @brief Call the simulated interrupt handler, once
+ */
+static void sleep_event_run(void)
+{
+    void (*event)(void) = sleep_event;
+    sleep_event = NULL;
+    event();
+}
+
 void mock_sleep_cpu(void)
 {
-    if (interrupts_enabled)
+    if (interrupts_enabled && sleep_mode_selected == SLEEP_MODE_PWR_DOWN)
+    {
+        /* Fake watchdog timing out, with TIMER0 paused, to wake CPU */
+        TEST_ASSERT_TRUE_MESSAGE(WDTCR & (1<<WDIE), "no watchdog to wake");
+        TEST_ASSERT_FALSE_MESSAGE(WDTCR & (1<<WDE), "watchdog would reset");
+        TEST_ASSERT_TRUE_MESSAGE(timer_prescale() == 0, "timer running");
+        uint64_t cycles = (uint64_t)(16u<<(WDTCR & 7))*(F_CPU/1000);
+        wdt_count++;
+        if (sleep_event && cycles_timer + cycles > sleep_event_cycles)
+        {
+            /* Woken early by another interrupt */
+            cycles = sleep_event_cycles - cycles_timer;
+            cycles_timer += cycles;
+            cycles_powered_down += cycles;
+            sleep_event_run();
+            return;
+        }
+        cycles_timer += cycles;
+        cycles_powered_down += cycles;
+        MOCK_IRQ(WDT_vect)();
+        TEST_ASSERT_FALSE(WDTCR & (1<<WDIE));
+    }
+    else if (interrupts_enabled)
     {
         /* Low power sleep */
         TEST_ASSERT_EQUAL(SLEEP_MODE_IDLE, sleep_mode_selected);
 
-        /* Fake interrupts to wake CPU */
-        milliseconds_timer++;
-        MOCK_IRQ(TIMER0_COMPA_vect)();
+        /* Fake timer running up to Compare Match to wake CPU */
+        TEST_ASSERT_TRUE_MESSAGE(timer_prescale() != 0, "timer stopped");
+        uint32_t counts = (uint8_t)(OCR0A - TCNT0) ? (uint8_t)(OCR0A - TCNT0) : 256;
+        uint64_t cycles = counts*timer_prescale() - cycles_partial;
+        if (sleep_event && cycles_timer + cycles > sleep_event_cycles)
+        {
+            /* Woken early by another interrupt, before Compare Match */
+            cycles = sleep_event_cycles - cycles_timer;
+            cycles_timer += cycles;
+            cycles_partial += cycles;
+            TCNT0 += cycles_partial/timer_prescale();
+            cycles_partial %= timer_prescale();
+            sleep_event_run();
+            return;
+        }
+        cycles_timer += cycles;
+        cycles_partial = 0;
+        TCNT0 = OCR0A;
+        TIFR |= 1<<OCF0A;
+        timer_interrupt();
     }
     else
     {
@@ -297,6 +1082,17 @@ void mock_cli(void)
 void mock_sei(void)
 {
     interrupts_enabled = true;
+    timer_interrupt();
+}
+
+void mock_eeprom_update_block(const void* src, void* dst, size_t n)
+{
+    TEST_ASSERT_TRUE_MESSAGE((uintptr_t)dst + n <= sizeof(eeprom), "beyond EEPROM");
+    (void)memcpy(&eeprom[(uintptr_t)dst], src, n);
+}
+
+void mock_wdt_reset(void)
+{
 }
 
 void mock_sleep_enable(void)
@@ -310,8 +1106,9 @@ void mock_set_sleep_mode(enum sleep_mode mode)
 }
 
 /*
- * We need to arrange to store 3 "tasks" in memory such that they are surrounded by
- * global symbols - see etc/linker.ld for details.
+ * We need to arrange to store 1+3 "tasks" in memory such that they are surrounded by
+ * global symbols - see etc/linker.ld for details. The 16-bit task is second in
+ * priority order, between 8-bit tasks.
  * There's no way to reliably do this in 'C' so we use a little bit of hopefully
  * portable assembler.
  */
@@ -320,9 +1117,10 @@ __asm__(
     "   .global __task_list_start   \n"
     "   .global __task_list_end     \n"
     "__task_list_start:             \n"
-    "   .int    0x1DEFACED          \n" /* Task 1 'pointer' */
-    "   .int    0x2DEFACED          \n" /* Task 2 'pointer' */
-    "   .int    0x3DEFACED          \n" /* Task 3 'pointer' */
+    "   .int    0x1DEFACED, 0       \n" /* Task 1 'pointer' */
+    "   .int    0x4DEFACED, 1       \n" /* 16-bit task 'pointer' */
+    "   .int    0x2DEFACED, 0       \n" /* Task 2 'pointer' */
+    "   .int    0x3DEFACED, 0       \n" /* Task 3 'pointer' */
     "__task_list_end:               \n"
 );
 #elif UINTPTR_MAX == 0xFFFFFFFFFFFFFFFFu
@@ -330,9 +1128,10 @@ __asm__(
     "   .global __task_list_start   \n"
     "   .global __task_list_end     \n"
     "__task_list_start:             \n"
-    "   .quad   0x1DEFACED          \n" /* Task 1 'pointer' */
-    "   .quad   0x2DEFACED          \n" /* Task 2 'pointer' */
-    "   .quad   0x3DEFACED          \n" /* Task 3 'pointer' */
+    "   .quad   0x1DEFACED, 0       \n" /* Task 1 'pointer' */
+    "   .quad   0x4DEFACED, 1       \n" /* 16-bit task 'pointer' */
+    "   .quad   0x2DEFACED, 0       \n" /* Task 2 'pointer' */
+    "   .quad   0x3DEFACED, 0       \n" /* Task 3 'pointer' */
     "__task_list_end:               \n"
 );
 #else
@@ -346,6 +1145,7 @@ __asm__(
  */
 void* mock_pgm_read_word_near(const void* ptr)
 {
+    flash_reads++;
     switch (*(uintptr_t*)ptr)
     {
     case 0x1DEFACED:
@@ -354,6 +1154,8 @@ void* mock_pgm_read_word_near(const void* ptr)
         return test_task[1];
     case 0x3DEFACED:
         return test_task[2];
+    case 0x4DEFACED:
+        return test_task16;
     default:
         TEST_FAIL_MESSAGE("unexpected trampoline");
         return NULL;
@@ -0,0 +1,76 @@
+/*! \file test_task_profile.c
+ *
+ *  \brief Scheduler profiling unit test
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "unity.h"  /* Framework */
+
+/* Module under test, built with profiling, and the simulated TIMER0,
+ * watchdog and EEPROM it runs on. Including them by macro stops task.c being
+ * linked in its production configuration.
+ */
+#define TASK_PROFILE 1
+#define TEST_TASK_SOURCE "test_task.c"
+#include TEST_TASK_SOURCE
+
+void test_profile(void)
+{
+    /* Saved to EEPROM, see task.c */
+    struct
+    {
+        uint8_t tasks;
+        uint8_t tasks16;
+        uint16_t prescale;
+        struct
+        {
+            uint32_t calls;
+            uint32_t total;
+            uint16_t min;
+            uint16_t max;
+        } task[4];
+    } profile;
+
+    /* Callbacks */
+    uint8_t busy(uint8_t ms_later)
+    {
+        static uint8_t counts = 1;
+
+        /* Busy for 1, 2, 3... timer counts */
+        if (ms_later == TASK_SHUTDOWN)
+            return TASK_SHUTDOWN;
+        if (ms_later == TASK_STARTUP)
+            counts = 1;
+        timer_run(counts++*timer_prescale());
+        return (counts <= 10) ? 5 : TASK_SHUTDOWN;
+    }
+
+    test_task[0] = busy;
+    test_task[1] = idle_task;
+    test_task[2] = idle_task;
+    task_main();
+
+    (void)memcpy(&profile, eeprom, sizeof(profile));
+    TEST_ASSERT_EQUAL(4, profile.tasks);
+    TEST_ASSERT_EQUAL(1, profile.tasks16);
+    TEST_ASSERT_EQUAL(timer_prescale(), profile.prescale);
+
+    /* In task list order, 16-bit task second */
+    TEST_ASSERT_EQUAL(10, profile.task[0].calls);
+    TEST_ASSERT_EQUAL(1, profile.task[0].min);
+    TEST_ASSERT_EQUAL(10, profile.task[0].max);
+    TEST_ASSERT_EQUAL(55, profile.task[0].total);
+    TEST_ASSERT_EQUAL(1, profile.task[1].calls);
+    TEST_ASSERT_EQUAL(1, profile.task[2].calls);
+    TEST_ASSERT_EQUAL(0, profile.task[2].max);
+}
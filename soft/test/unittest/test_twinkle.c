@@ -23,6 +23,10 @@ static uint8_t pwm0, pwm1;
 #define PWM_STUB "pwm.h"
 #include PWM_STUB
 
+#include <stdbool.h>
+
+static bool pwm_batched;  /**< between pwm_begin() and pwm_commit() */
+
 /**
  * @brief We mock our own PWM because it's easier than predicting order of setting
  * @param channel to set
@@ -30,6 +34,9 @@ static uint8_t pwm0, pwm1;
  */
 extern void pwm_set(uint8_t channel, uint8_t duty)
 {
+    /* Channels are always set together */
+    TEST_ASSERT_TRUE_MESSAGE(pwm_batched, "pwm_set() outside pwm_begin()");
+
     switch(channel)
     {
     case 0:
@@ -43,6 +50,18 @@ extern void pwm_set(uint8_t channel, uint8_t duty)
     }
 }
 
+extern void pwm_begin(void)
+{
+    TEST_ASSERT_FALSE_MESSAGE(pwm_batched, "pwm_begin() twice");
+    pwm_batched = true;
+}
+
+extern void pwm_commit(void)
+{
+    TEST_ASSERT_TRUE_MESSAGE(pwm_batched, "pwm_commit() without pwm_begin()");
+    pwm_batched = false;
+}
+
 #define CH_0_POS 0      /**< matches ../stubs/twinkle.config */
 #define CH_1_POS 128    /**< matches ../stubs/twinkle.config */
 